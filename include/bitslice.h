@@ -0,0 +1,189 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cells.h"
+#include "rules.h"
+#include "topology.h"
+
+// Bit-sliced fields: 64 universes of the same size side by side, bit k of every cell word
+// belonging to universe k, so one pass of word operations steps all of them. The rule
+// becomes a circuit: each row's cells are summed three (or two) at a time into two-bit
+// column sums, three rows of those add up to the 3x3 (hex, von Neumann) sum in four bit
+// planes, and the birth and survival counts pick the lanes that are alive next. Only
+// outer-totalistic two-state rules with range 1 fit; the halo follows the topology as
+// FillHalo does. Rows are plain word loops, which compilers vectorise further.
+
+#define SLICE_LANES 64
+
+typedef struct slicedField {
+    int size;
+    size_t stride;          // size + 2, the halo ring around the cells
+    uint64_t* cells;        // Cell i, j at (i + 1) * stride + j + 1
+    uint64_t* sums;         // Column sums of three rows, two planes each, then the four planes of a row's sums; for stepping into this field
+} slicedField;
+
+bool SlicedRule(const rule* rule) { // Whether StepSliced can run the rule
+    return rule->states == 2 && rule->range <= 1 && !rule->nonTotalistic;
+}
+
+bool CreateSlicedField(slicedField* field, int size) {
+    field->size = size;
+    field->stride = (size_t)size + 2;
+    field->cells = (uint64_t*)calloc(field->stride * field->stride, sizeof(uint64_t));
+    field->sums = (uint64_t*)malloc(10 * field->stride * sizeof(uint64_t));
+    return field->cells != NULL && field->sums != NULL;
+}
+
+void FreeSlicedField(slicedField* field) {
+    free(field->cells);
+    free(field->sums);
+    memset(field, 0, sizeof(*field));
+}
+
+static inline uint64_t* slicedRow(const slicedField* field, int i) { // Column 0 of row i, rows and columns -1 and size are the halo
+    return field->cells + (size_t)(i + 1) * field->stride + 1;
+}
+
+void LoadUniverse(slicedField* sliced, int lane, bool** field) { // Copies a bool field into one lane
+    uint64_t bit = 1ull << lane;
+    for (int i = 0; i < sliced->size; i++) {
+        uint64_t* row = slicedRow(sliced, i);
+        for (int j = 0; j < sliced->size; j++) row[j] = (row[j] & ~bit) | ((uint64_t)field[i][j] << lane);
+    }
+}
+
+void ExtractUniverse(const slicedField* sliced, int lane, bool** field) {
+    for (int i = 0; i < sliced->size; i++) {
+        const uint64_t* row = slicedRow(sliced, i);
+        for (int j = 0; j < sliced->size; j++) field[i][j] = (row[j] >> lane) & 1;
+    }
+}
+
+uint64_t SlicedDifference(const slicedField* a, const slicedField* b) { // Lanes where the two fields differ
+    uint64_t differ = 0;
+    for (int i = 0; i < a->size; i++) {
+        const uint64_t* rowA = slicedRow(a, i);
+        const uint64_t* rowB = slicedRow(b, i);
+        for (int j = 0; j < a->size; j++) differ |= rowA[j] ^ rowB[j];
+    }
+    return differ;
+}
+
+static void transposeLanes(uint64_t block[64]) { // Word k bit c to word 63 - c bit 63 - k, so word 63 - lane holds that lane's 64 cells
+    uint64_t mask = 0x00000000ffffffffull;
+    for (int j = 32; j != 0; j >>= 1, mask ^= mask << j) {
+        for (int k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+            uint64_t t = (block[k] ^ (block[k | j] >> j)) & mask;
+            block[k] ^= t;
+            block[k | j] ^= t << j;
+        }
+    }
+}
+
+void LaneHashes(const slicedField* field, uint64_t hashes[SLICE_LANES]) { // A hash of each lane's cells, for telling its generations apart
+    uint64_t block[64];
+    memset(hashes, 0, SLICE_LANES * sizeof(uint64_t));
+    for (int i = 0; i < field->size; i++) {
+        const uint64_t* row = slicedRow(field, i);
+        for (int j = 0; j < field->size; j += 64) { // 64 cells of every lane per transpose
+            int cells = field->size - j < 64 ? field->size - j : 64;
+            memcpy(block, row + j, cells * sizeof(uint64_t));
+            memset(block + cells, 0, (64 - cells) * sizeof(uint64_t));
+            transposeLanes(block);
+            for (int lane = 0; lane < SLICE_LANES; lane++) hashes[lane] = ((hashes[lane] << 27 | hashes[lane] >> 37) ^ block[63 - lane]) * 0x9e3779b97f4a7c15ull + 1; // Mixed fully below; + 1 keeps empty stretches counted
+        }
+    }
+    for (int lane = 0; lane < SLICE_LANES; lane++) hashes[lane] = mixHash(hashes[lane]);
+}
+
+static void slicedHalo(slicedField* field, topology kind) {
+    int size = field->size;
+    for (int i = -1; i <= size; i++) {
+        for (int j = -1; j <= size; j++) {
+            if (i >= 0 && i < size && j >= 0 && j < size) j = size; // Only the ring
+            int row = i, column = j;
+            slicedRow(field, i)[j] = haloSource(kind, size, &row, &column) ? slicedRow(field, row)[column] : 0;
+        }
+    }
+}
+
+static inline void addThree(uint64_t a, uint64_t b, uint64_t c, uint64_t* low, uint64_t* high) {
+    uint64_t half = a ^ b;
+    *low = half ^ c;
+    *high = (a & b) | (c & half);
+}
+
+static void columnSums(neighbourhoodKind kind, const uint64_t* row, int size, int offset, bool centre, uint64_t* low, uint64_t* high) {
+    // What one row adds to the sum of the cells below it: three cells for Moore rows and the
+    // middle of any neighbourhood, two for the outer hex rows, one for the outer von Neumann rows
+    for (int j = 0; j < size; j++) {
+        if (centre || kind == NEIGHBOURHOOD_MOORE) {
+            addThree(row[j - 1], row[j], row[j + 1], &low[j], &high[j]);
+        } else if (kind == NEIGHBOURHOOD_HEX) {
+            low[j] = row[j + offset] ^ row[j + offset + 1];
+            high[j] = row[j + offset] & row[j + offset + 1];
+        } else {
+            low[j] = row[j];
+            high[j] = 0;
+        }
+    }
+}
+
+void StepSliced(const rule* rule, topology kind, slicedField* current, slicedField* next) { // All 64 lanes one generation on
+    int size = current->size;
+    neighbourhoodKind shape = (neighbourhoodKind)rule->neighbourhood;
+    size_t stride = next->stride;
+    uint64_t* low[3] = {next->sums, next->sums + 2 * stride, next->sums + 4 * stride};
+    uint64_t* high[3] = {next->sums + stride, next->sums + 3 * stride, next->sums + 5 * stride};
+    uint64_t* s0 = next->sums + 6 * stride;
+    uint64_t* s1 = next->sums + 7 * stride;
+    uint64_t* s2 = next->sums + 8 * stride;
+    uint64_t* s3 = next->sums + 9 * stride;
+    unsigned terms[10], termCount = 0; // Sums that decide a lane, bit 4 set for dead lanes, bit 5 for live ones
+    for (unsigned n = 0; n <= 9; n++) {
+        unsigned term = n | (n <= 8 && rule->birth >> n & 1) << 4 | (n >= 1 && rule->survive >> (n - 1) & 1) << 5;
+        if (term > 15) terms[termCount++] = term;
+    }
+    slicedHalo(current, kind);
+
+    for (int i = 0; i < size; i++) {
+        int offset = i & 1 ? 0 : -1; // Hex rows, see neighbourWord
+        if (shape != NEIGHBOURHOOD_MOORE || i == 0) {
+            columnSums(shape, slicedRow(current, i - 1), size, offset, false, low[0], high[0]);
+            columnSums(shape, slicedRow(current, i), size, offset, true, low[1], high[1]);
+        } else { // Moore rows add the same whether above, at or below the cell, so the last two carry over
+            uint64_t* swapLow = low[0];
+            uint64_t* swapHigh = high[0];
+            low[0] = low[1];
+            high[0] = high[1];
+            low[1] = low[2];
+            high[1] = high[2];
+            low[2] = swapLow;
+            high[2] = swapHigh;
+        }
+        columnSums(shape, slicedRow(current, i + 1), size, offset, false, low[2], high[2]);
+        const uint64_t* mid = slicedRow(current, i);
+        uint64_t* out = slicedRow(next, i);
+        for (int j = 0; j < size; j++) { // Three two-bit sums into four bit planes, the centre cell included
+            uint64_t carry, ones, twos;
+            addThree(low[0][j], low[1][j], low[2][j], &s0[j], &carry);
+            addThree(high[0][j], high[1][j], high[2][j], &ones, &twos);
+            s1[j] = ones ^ carry;
+            uint64_t over = ones & carry;
+            s2[j] = twos ^ over;
+            s3[j] = twos & over;
+            out[j] = 0;
+        }
+        for (unsigned t = 0; t < termCount; t++) { // One pass per deciding sum keeps the loops free of branches
+            unsigned n = terms[t] & 15;
+            uint64_t dead = terms[t] & 16 ? ~0ull : 0, live = terms[t] & 32 ? ~0ull : 0;
+            uint64_t flip0 = n & 1 ? 0 : ~0ull, flip1 = n & 2 ? 0 : ~0ull, flip2 = n & 4 ? 0 : ~0ull, flip3 = n & 8 ? 0 : ~0ull;
+            for (int j = 0; j < size; j++) {
+                uint64_t lanes = (dead & ~mid[j]) | (live & mid[j]);
+                out[j] |= (s0[j] ^ flip0) & (s1[j] ^ flip1) & (s2[j] ^ flip2) & (s3[j] ^ flip3) & lanes;
+            }
+        }
+    }
+}
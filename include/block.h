@@ -0,0 +1,91 @@
+#pragma once
+#include <stdbool.h>
+#include <string.h>
+#include "rules.h"
+
+// Steps the field in 2x2 blocks: the 4x4 cells around a block form a 16-bit index into a
+// table holding the block's next state, so any rule costs one lookup per four cells.
+
+#define BLOCK_TABLE 65536
+
+typedef struct blockEngine {
+    unsigned char table[BLOCK_TABLE]; // Bits 0-3: next state of the centre cells (1,1) (1,2) (2,1) (2,2)
+    rule built;                        // Rule the table was built for
+    bool ready;
+} blockEngine;
+
+static blockEngine blocks;
+
+void BuildBlockTable(const rule* rule) {
+    for (unsigned index = 0; index < BLOCK_TABLE; index++) { // Bit r * 4 + c is the cell at row r, column c
+        unsigned char result = 0;
+        for (int cell = 0; cell < 4; cell++) {
+            int row = 1 + cell / 2;
+            int col = 1 + cell % 2;
+            unsigned neighbourhood = 0;
+            for (int dr = -1; dr <= 1; dr++) {
+                for (int dc = -1; dc <= 1; dc++) {
+                    unsigned bit = (index >> ((row + dr) * 4 + col + dc)) & 1;
+                    neighbourhood |= bit << ((dr + 1) * 3 + dc + 1);
+                }
+            }
+            result |= (unsigned char)(RuleApply(rule, neighbourhood, row - 1) << cell); // Blocks start on even rows
+        }
+        blocks.table[index] = result;
+    }
+    blocks.built = *rule;
+    blocks.ready = true;
+}
+
+void PrepareBlockTable(const rule* rule) { // Rebuilds only when the rule changed
+    if (!blocks.ready || memcmp(&blocks.built, rule, sizeof(*rule)) != 0) {
+        BuildBlockTable(rule);
+    }
+}
+
+void StepBlockRows(bool** current, bool** next, int size, int begin, int end) { // begin is even, rows past size are not written
+    for (int i = begin; i < end; i += 2) {
+        const bool* rows[4];
+        for (int r = 0; r < 4; r++) { // Rows i-1..i+2 from the halo, the last pair of an odd size reuses the bottom halo row
+            rows[r] = current[i - 1 + r <= size ? i - 1 + r : size];
+        }
+        bool* top = next[i];
+        bool* bottom = i + 1 < size ? next[i + 1] : NULL;
+
+        unsigned window = 0; // Four 4-bit row slices of columns j-1..j+2
+        for (int r = 0; r < 4; r++) {
+            window |= (unsigned)(rows[r][-1] | rows[r][0] << 1) << (r * 4);
+        }
+
+        int j = 0;
+        if (bottom != NULL) {
+            for (; j + 2 <= size; j += 2) { // Whole blocks need no clipping
+                window &= 0x3333;
+                for (int r = 0; r < 4; r++) {
+                    window |= (unsigned)(rows[r][j + 1] << 2 | rows[r][j + 2] << 3) << (r * 4);
+                }
+                unsigned char result = blocks.table[window];
+                top[j] = result & 1;
+                top[j + 1] = (result >> 1) & 1;
+                bottom[j] = (result >> 2) & 1;
+                bottom[j + 1] = (result >> 3) & 1;
+                window >>= 2;
+            }
+        }
+        for (; j < size; j += 2) { // Column size + 1 is a spare zero column past the halo
+            window &= 0x3333;
+            for (int r = 0; r < 4; r++) {
+                window |= (unsigned)(rows[r][j + 1] << 2 | rows[r][j + 2] << 3) << (r * 4);
+            }
+
+            unsigned char result = blocks.table[window];
+            top[j] = result & 1;
+            if (j + 1 < size) top[j + 1] = (result >> 1) & 1;
+            if (bottom != NULL) {
+                bottom[j] = (result >> 2) & 1;
+                if (j + 1 < size) bottom[j + 1] = (result >> 3) & 1;
+            }
+            window >>= 2; // Columns j+1, j+2 become the next block's left two
+        }
+    }
+}
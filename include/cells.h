@@ -0,0 +1,99 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "rules.h"
+
+// Word-at-a-time helpers shared by the step engines. Cells are 0/1 bytes and rows are
+// padded, so whole 64-bit words can be loaded past the last cell. The cell right after
+// the row is the halo, so anything counted must mask it off.
+
+static inline uint64_t loadCells(const bool* cells) {
+    uint64_t word;
+    memcpy(&word, cells, sizeof(word));
+    return word;
+}
+
+// Neighbour sums for eight cells at once. Hex rows see columns j + offset and j + offset + 1
+// above and below: offset -1 on even rows, 0 on odd rows.
+static inline uint64_t neighbourWord(neighbourhoodKind kind, const bool* up, const bool* mid, const bool* down, int j, int offset) {
+    switch (kind) {
+    case NEIGHBOURHOOD_HEX:
+        return loadCells(up + j + offset) + loadCells(up + j + offset + 1)
+             + loadCells(mid + j - 1) + loadCells(mid + j + 1)
+             + loadCells(down + j + offset) + loadCells(down + j + offset + 1);
+    case NEIGHBOURHOOD_VON_NEUMANN:
+        return loadCells(up + j) + loadCells(mid + j - 1) + loadCells(mid + j + 1) + loadCells(down + j);
+    default:
+        return loadCells(up + j - 1) + loadCells(up + j) + loadCells(up + j + 1)
+             + loadCells(mid + j - 1) + loadCells(mid + j + 1)
+             + loadCells(down + j - 1) + loadCells(down + j) + loadCells(down + j + 1);
+    }
+}
+
+static inline int neighbourCount(neighbourhoodKind kind, const bool* up, const bool* mid, const bool* down, int j, int offset) {
+    switch (kind) {
+    case NEIGHBOURHOOD_HEX:
+        return up[j + offset] + up[j + offset + 1] + mid[j - 1] + mid[j + 1] + down[j + offset] + down[j + offset + 1];
+    case NEIGHBOURHOOD_VON_NEUMANN:
+        return up[j] + mid[j - 1] + mid[j + 1] + down[j];
+    default:
+        return up[j - 1] + up[j] + up[j + 1] + mid[j - 1] + mid[j + 1] + down[j - 1] + down[j] + down[j + 1];
+    }
+}
+
+static uint64_t cellSpread[256]; // Byte bit k as cell k of a word, for unpacking bit planes
+
+static void buildCellSpread(void) {
+    if (cellSpread[255] != 0) return;
+    for (int byte = 0; byte < 256; byte++) {
+        for (int k = 0; k < 8; k++) cellSpread[byte] |= (uint64_t)((byte >> k) & 1) << (k * 8);
+    }
+}
+
+long long CountRow(const bool* row, const unsigned short size) { // Cells are 0/1 bytes, so a word's popcount is its live count
+    long long count = 0;
+    int j = 0;
+    for (; j + 8 <= size; j += 8) {
+        uint64_t word;
+        memcpy(&word, row + j, sizeof(word));
+        count += __builtin_popcountll(word);
+    }
+    for (; j < size; j++) {
+        count += row[j];
+    }
+    return count;
+}
+
+static uint64_t mixHash(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static uint64_t hashBytes(const unsigned char* bytes, int length, int index) {
+    uint64_t hash = 0x9e3779b97f4a7c15ull * (uint64_t)(index + 1);
+    for (int j = 0; j < length; j += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + j, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ull;
+        hash ^= hash >> 29;
+    }
+    return mixHash(hash);
+}
+
+static uint64_t scanRow(const bool* row, const unsigned short size, int index, long long* population) {
+    uint64_t hash = 0x9e3779b97f4a7c15ull * (uint64_t)(index + 1);
+    for (int j = 0; j < size; j += 8) {
+        uint64_t word;
+        memcpy(&word, row + j, sizeof(word));
+        if (size - j < 8) word &= ~0ull >> (64 - 8 * (size - j)); // Drop the halo and padding
+        *population += __builtin_popcountll(word);
+        hash = (hash ^ word) * 0x100000001b3ull;
+        hash ^= hash >> 29;
+    }
+    return mixHash(hash);
+}
@@ -0,0 +1,504 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "threads.h"
+#include "cells.h"
+#include "cycle.h"
+#include "frames.h"
+#include "label.h"
+#include "random.h"
+#include "topology.h"
+#include "stats.h"
+#include "trace.h"
+
+// Soup census. Each worker fills its own field with a seeded random soup, steps it alone
+// until the cycle detector sees it repeat, then cuts the result into 8-connected objects
+// with the labeller.
+// An object is stepped in isolation until it comes back: in place after one step it is a
+// still life, later an oscillator, moved a spaceship. It is named with its apgcode (the
+// shortest extended Wechsler string over all phases and orientations, e.g. xs4_33 for
+// the block), so census files compare with other searches. Objects seen before are
+// recognised by their component hash without stepping. All buffers belong to the
+// worker and are allocated once; soup k only depends on the seed and k, not on the
+// worker that ran it.
+
+#define CENSUS_MAX_PERIOD 64   // Objects that don't come back within this many steps are unknown
+#define CENSUS_MARGIN 8        // Free cells around an object stepped in isolation
+#define CENSUS_BATCH 64        // Soups per worker between progress lines
+
+typedef struct censusConfig {
+    unsigned long long soups, seed, generations;
+    int soupSize, fieldSize, history;
+} censusConfig;
+
+typedef struct censusObject {
+    char* code;
+    unsigned long long count;
+} censusObject;
+
+typedef struct censusTable {   // Counts by code
+    censusObject* objects;
+    int count, capacity;
+    int* slots;                // Object index + 1, 0 when empty
+    int slotCount;
+} censusTable;
+
+typedef struct censusCache {   // Cell hash of an object as found to its index in the worker's table
+    uint64_t* keys;            // 0 when empty
+    int* objects;
+    int count, capacity;
+} censusCache;
+
+typedef struct censusWorker {
+    bool** field[2];
+    bool** isolated[2];
+    cycleDetector cycles;
+    uint64_t* packed;          // The settled field for the labeller
+    labeller labels;
+    unsigned char* bitmap;     // The object, one byte per cell of its bounding box
+    unsigned char* shape;      // One phase in one orientation
+    char* code;
+    char* best;
+    censusTable table;
+    censusCache cache;
+    unsigned long long soups, unstable;
+    bool failed;
+} censusWorker;
+
+typedef struct censusJob {
+    const censusConfig* config;
+    unsigned long long first;  // Index of the batch's first soup
+} censusJob;
+
+static censusWorker censusWorkers[MAX_WORKERS];
+
+static uint64_t hashCode(const char* code) { // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (; *code; code++) hash = (hash ^ (unsigned char)*code) * 0x100000001b3ull;
+    return hash;
+}
+
+static bool censusGrow(censusTable* table) {
+    int slotCount = table->slotCount ? table->slotCount * 2 : 256;
+    int* slots = (int*)calloc(slotCount, sizeof(int));
+    if (slots == NULL) return false;
+    for (int i = 0; i < table->count; i++) {
+        int slot = (int)(hashCode(table->objects[i].code) & (slotCount - 1));
+        while (slots[slot] != 0) slot = (slot + 1) & (slotCount - 1);
+        slots[slot] = i + 1;
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->slotCount = slotCount;
+    return true;
+}
+
+static int censusAdd(censusTable* table, const char* code, unsigned long long count) { // Index of the code's entry, -1 when out of memory
+    if ((table->count + 1) * 2 > table->slotCount && !censusGrow(table)) return -1;
+    int slot = (int)(hashCode(code) & (table->slotCount - 1));
+    while (table->slots[slot] != 0) {
+        censusObject* object = &table->objects[table->slots[slot] - 1];
+        if (strcmp(object->code, code) == 0) {
+            object->count += count;
+            return table->slots[slot] - 1;
+        }
+        slot = (slot + 1) & (table->slotCount - 1);
+    }
+    if (table->count == table->capacity) {
+        int capacity = table->capacity ? table->capacity * 2 : 64;
+        censusObject* grown = (censusObject*)realloc(table->objects, capacity * sizeof(censusObject));
+        if (grown == NULL) return -1;
+        table->objects = grown;
+        table->capacity = capacity;
+    }
+    char* copy = strdup(code);
+    if (copy == NULL) return -1;
+    table->objects[table->count].code = copy;
+    table->objects[table->count].count = count;
+    table->slots[slot] = ++table->count;
+    return table->count - 1;
+}
+
+static void freeCensusTable(censusTable* table) {
+    for (int i = 0; i < table->count; i++) free(table->objects[i].code);
+    free(table->objects);
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+static int cacheFind(const censusCache* cache, uint64_t key) {
+    if (cache->capacity == 0) return -1;
+    int slot = (int)(key & (cache->capacity - 1));
+    while (cache->keys[slot] != 0) {
+        if (cache->keys[slot] == key) return cache->objects[slot];
+        slot = (slot + 1) & (cache->capacity - 1);
+    }
+    return -1;
+}
+
+static void cachePut(censusCache* cache, uint64_t key, int object) { // A full cache only costs speed
+    if ((cache->count + 1) * 2 > cache->capacity) {
+        int capacity = cache->capacity ? cache->capacity * 2 : 1024;
+        uint64_t* keys = (uint64_t*)calloc(capacity, sizeof(uint64_t));
+        int* objects = (int*)malloc(capacity * sizeof(int));
+        if (keys == NULL || objects == NULL) {
+            free(keys);
+            free(objects);
+            return;
+        }
+        for (int i = 0; i < cache->capacity; i++) {
+            if (cache->keys[i] == 0) continue;
+            int slot = (int)(cache->keys[i] & (capacity - 1));
+            while (keys[slot] != 0) slot = (slot + 1) & (capacity - 1);
+            keys[slot] = cache->keys[i];
+            objects[slot] = cache->objects[i];
+        }
+        free(cache->keys);
+        free(cache->objects);
+        cache->keys = keys;
+        cache->objects = objects;
+        cache->capacity = capacity;
+    }
+    int slot = (int)(key & (cache->capacity - 1));
+    while (cache->keys[slot] != 0 && cache->keys[slot] != key) slot = (slot + 1) & (cache->capacity - 1);
+    if (cache->keys[slot] == 0) cache->count++;
+    cache->keys[slot] = key;
+    cache->objects[slot] = object;
+}
+
+static void clearField(bool** field, int size) {
+    for (int i = 0; i < size; i++) memset(field[i], 0, size);
+}
+
+static void placeSoup(bool** field, int size, int soupSize, unsigned long long seed, unsigned long long soup) { // Half the cells live, centred
+    uint64_t state = mixHash(seed ^ mixHash(soup + 1));
+    int corner = (size - soupSize) / 2;
+    clearField(field, size);
+    for (int i = 0; i < soupSize; i++) {
+        uint64_t bits = 0;
+        for (int j = 0; j < soupSize; j++, bits >>= 1) {
+            if ((j & 63) == 0) bits = splitMix(&state);
+            field[corner + i][corner + j] = bits & 1;
+        }
+    }
+}
+
+static size_t encodeWechsler(const unsigned char* cells, int width, int height, char* out) { // Strips of five rows, a base-32 digit per column, runs of blank columns shortened
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    size_t length = 0;
+    for (int top = 0; top < height; top += 5) {
+        if (top > 0) out[length++] = 'z';
+        int last = -1;
+        for (int x = 0; x < width; x++) {
+            for (int y = top; y < top + 5 && y < height; y++) {
+                if (cells[y * width + x]) last = x;
+            }
+        }
+        int zeros = 0;
+        for (int x = 0; x <= last; x++) {
+            int value = 0;
+            for (int y = top; y < top + 5 && y < height; y++) value |= cells[y * width + x] << (y - top);
+            if (value == 0) {
+                zeros++;
+                continue;
+            }
+            while (zeros > 0) {
+                int run = zeros > 39 ? 39 : zeros;
+                if (run >= 4) {
+                    out[length++] = 'y';
+                    out[length++] = digits[run - 4];
+                } else if (run == 3) {
+                    out[length++] = 'x';
+                } else if (run == 2) {
+                    out[length++] = 'w';
+                } else {
+                    out[length++] = '0';
+                }
+                zeros -= run;
+            }
+            out[length++] = digits[value];
+        }
+    }
+    out[length] = '\0';
+    return length;
+}
+
+static void bestOrientation(censusWorker* worker, const unsigned char* cells, int width, int height) { // Keeps the shortest, then lowest, code in best
+    for (int orientation = 0; orientation < 8; orientation++) {
+        bool swap = orientation & 4;
+        int w = swap ? height : width;
+        int h = swap ? width : height;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int tx = swap ? y : x;
+                int ty = swap ? x : y;
+                if (orientation & 1) tx = w - 1 - tx;
+                if (orientation & 2) ty = h - 1 - ty;
+                worker->shape[ty * w + tx] = cells[y * width + x];
+            }
+        }
+        size_t length = encodeWechsler(worker->shape, w, h, worker->code);
+        size_t bestLength = strlen(worker->best);
+        if (worker->best[0] == '\0' || length < bestLength || (length == bestLength && strcmp(worker->code, worker->best) < 0)) {
+            memcpy(worker->best, worker->code, length + 1);
+        }
+    }
+}
+
+static long long fieldBox(bool** field, int size, int* left, int* top, int* right, int* bottom) { // Live cells and their bounding box
+    long long population = 0;
+    *left = size;
+    *top = size;
+    *right = *bottom = -1;
+    for (int i = 0; i < size; i++) {
+        long long count = CountRow(field[i], size);
+        if (count == 0) continue;
+        population += count;
+        if (*top == size) *top = i;
+        *bottom = i;
+        for (int j = 0; j < size; j++) {
+            if (!field[i][j]) continue;
+            if (j < *left) *left = j;
+            if (j > *right) *right = j;
+        }
+    }
+    return population;
+}
+
+static void placeBitmap(bool** field, int size, const unsigned char* cells, int width, int height) {
+    int left = (size - width) / 2, top = (size - height) / 2;
+    clearField(field, size);
+    for (int y = 0; y < height; y++) memcpy(field[top + y] + left, cells + y * width, width);
+}
+
+static bool matchesBitmap(bool** field, int left, int top, const unsigned char* cells, int width, int height) {
+    for (int y = 0; y < height; y++) {
+        if (memcmp(field[top + y] + left, cells + y * width, width) != 0) return false;
+    }
+    return true;
+}
+
+static void objectBitmap(censusWorker* worker, const labeller* labels, const component* object) { // One byte per cell of the bounding box, unwrapped across the torus
+    int size = labels->size;
+    memset(worker->bitmap, 0, (size_t)object->width * object->height);
+    for (int k = object->firstRun; k < object->firstRun + object->runCount; k++) {
+        const labelRun* run = &labels->runs[labels->order[k]];
+        unsigned char* row = worker->bitmap + (size_t)wrapIndex(run->row - object->top, size) * object->width;
+        for (int j = run->start; j <= run->end; j++) row[wrapIndex(j - object->left, size)] = 1; // Gap 1, so runs are all live
+    }
+}
+
+static void classifyObject(censusWorker* worker, const labeller* labels, const component* object, int index) { // Sets worker->failed when the table cannot grow
+    int size = labels->size, width = object->width, height = object->height;
+    long long count = object->population;
+    if (width > size - 2 * CENSUS_MARGIN || height > size - 2 * CENSUS_MARGIN) {
+        if (censusAdd(&worker->table, "zz_OVERSIZED", 1) < 0) worker->failed = true;
+        return;
+    }
+    uint64_t key = mixHash(object->hash ^ ((uint64_t)width << 32 | (uint64_t)height)) | 1; // 0 marks an empty slot
+    int found = cacheFind(&worker->cache, key);
+    if (found >= 0) {
+        worker->table.objects[found].count++;
+        return;
+    }
+    objectBitmap(worker, labels, object);
+
+    bool** current = worker->isolated[0];
+    bool** next = worker->isolated[1];
+    int homeLeft = (size - width) / 2, homeTop = (size - height) / 2;
+    int period = 0;
+    bool moved = false;
+    placeBitmap(current, size, worker->bitmap, width, height);
+    for (int t = 1; t <= CENSUS_MAX_PERIOD && period == 0; t++) {
+        stepResult result = StepAlone(current, next, size, index);
+        bool** swap = current;
+        current = next;
+        next = swap;
+        if (result.population != count) continue;
+        int l, tp, r, b;
+        fieldBox(current, size, &l, &tp, &r, &b);
+        if (r - l + 1 != width || b - tp + 1 != height || !matchesBitmap(current, l, tp, worker->bitmap, width, height)) continue;
+        period = t;
+        moved = l != homeLeft || tp != homeTop;
+    }
+    if (period == 0) {
+        if (censusAdd(&worker->table, "zz_UNKNOWN", 1) < 0) worker->failed = true;
+        return;
+    }
+
+    worker->best[0] = '\0';
+    current = worker->isolated[0];
+    next = worker->isolated[1];
+    placeBitmap(current, size, worker->bitmap, width, height);
+    for (int phase = 0; phase < period; phase++) {
+        int l, tp, r, b;
+        fieldBox(current, size, &l, &tp, &r, &b);
+        int w = r - l + 1, h = b - tp + 1;
+        for (int y = 0; y < h; y++) memcpy(worker->bitmap + (size_t)y * w, current[tp + y] + l, w); // bitmap is reused, phase 0 is done with
+        bestOrientation(worker, worker->bitmap, w, h);
+        StepAlone(current, next, size, index);
+        bool** swap = current;
+        current = next;
+        next = swap;
+    }
+    int length = snprintf(worker->code, 32, moved ? "xq%lld_" : period == 1 ? "xs%lld_" : "xp%lld_", period == 1 ? count : (long long)period);
+    memcpy(worker->code + length, worker->best, strlen(worker->best) + 1);
+    found = censusAdd(&worker->table, worker->code, 1);
+    if (found < 0) {
+        worker->failed = true;
+        return;
+    }
+    cachePut(&worker->cache, key, found);
+}
+
+static void censusObjects(censusWorker* worker, bool** field, int size, int index) { // 8-connected objects, wrapping only on a torus
+    packJob job = {field, size, ((size_t)size + 63) / 64, worker->packed};
+    packRows(&job, 0, size, index);
+    int count = LabelPacked(&worker->labels, worker->packed, size, 1, activeTopology == TOPOLOGY_TORUS, false); // Twisted edges are cut, as on a plane
+    if (count < 0) {
+        worker->failed = true;
+        return;
+    }
+    for (int c = 0; c < count && !worker->failed; c++) classifyObject(worker, &worker->labels, &worker->labels.components[c], index);
+}
+
+static void runSoup(censusWorker* worker, const censusConfig* config, unsigned long long soup, int index) {
+    int size = config->fieldSize;
+    placeSoup(worker->field[0], size, config->soupSize, config->seed, soup);
+    ResetCycleDetector(&worker->cycles);
+    bool** current = worker->field[0];
+    bool** next = worker->field[1];
+    bool settled = false;
+    for (unsigned long long generation = 1; generation <= config->generations && !settled; generation++) {
+        settled = ObserveGeneration(&worker->cycles, generation, StepAlone(current, next, size, index).hash);
+        bool** swap = current;
+        current = next;
+        next = swap;
+    }
+    worker->soups++;
+    if (!settled) {
+        worker->unstable++;
+        return;
+    }
+    censusObjects(worker, current, size, index);
+}
+
+static void censusBand(void* arg, int begin, int end, int worker) {
+    censusJob* job = (censusJob*)arg;
+    TRACE_SCOPE("census");
+    for (int i = begin; i < end && !censusWorkers[worker].failed; i++) runSoup(&censusWorkers[worker], job->config, job->first + i, worker);
+}
+
+static bool createCensusWorker(censusWorker* worker, const censusConfig* config) {
+    int size = config->fieldSize;
+    size_t cells = (size_t)size * size;
+    memset(worker, 0, sizeof(*worker));
+    for (int k = 0; k < 2; k++) {
+        worker->field[k] = CreateField(size);
+        worker->isolated[k] = CreateField(size);
+    }
+    CreateCycleDetector(&worker->cycles, config->history);
+    worker->packed = (uint64_t*)malloc(((size_t)size + 63) / 64 * size * sizeof(uint64_t));
+    worker->bitmap = (unsigned char*)malloc(cells);
+    worker->shape = (unsigned char*)malloc(cells);
+    worker->code = (char*)malloc(cells + cells / 5 + 64); // A digit per cell, a z per strip and the prefix
+    worker->best = (char*)malloc(cells + cells / 5 + 64);
+    return worker->cycles.table != NULL && worker->cycles.recent != NULL && worker->packed != NULL &&
+           worker->bitmap != NULL && worker->shape != NULL && worker->code != NULL && worker->best != NULL;
+}
+
+static void freeCensusWorker(censusWorker* worker, int size) {
+    for (int k = 0; k < 2; k++) {
+        FreeField(worker->field[k], size);
+        FreeField(worker->isolated[k], size);
+    }
+    FreeCycleDetector(&worker->cycles);
+    free(worker->packed);
+    FreeLabeller(&worker->labels);
+    free(worker->bitmap);
+    free(worker->shape);
+    free(worker->code);
+    free(worker->best);
+    freeCensusTable(&worker->table);
+    free(worker->cache.keys);
+    free(worker->cache.objects);
+    memset(worker, 0, sizeof(*worker));
+}
+
+static int compareObjects(const void* a, const void* b) { // Most common first, then by code
+    const censusObject* x = (const censusObject*)a;
+    const censusObject* y = (const censusObject*)b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return strcmp(x->code, y->code);
+}
+
+static bool writeCensus(const char* filename, const censusConfig* config, censusTable* total, unsigned long long soups, unsigned long long unstable, double seconds) {
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) return false;
+    qsort(total->objects, total->count, sizeof(censusObject), compareObjects);
+    unsigned long long objects = 0;
+    for (int i = 0; i < total->count; i++) objects += total->objects[i].count;
+    fprintf(file, "# rule %s, %s %dx%d, %llu soups of %dx%d from seed %llu, %.0f soups/s\n", activeRule.name,
+            topologyNames[activeTopology], config->fieldSize, config->fieldSize, soups, config->soupSize, config->soupSize,
+            config->seed, seconds > 0 ? soups / seconds : 0);
+    fprintf(file, "# %llu objects, %llu soups unsettled after %llu generations\n", objects, unstable, config->generations);
+    for (int i = 0; i < total->count; i++) {
+        fprintf(file, "%s %llu\n", total->objects[i].code, total->objects[i].count);
+    }
+    free(total->slots); // The order no longer matches the slots
+    total->slots = NULL;
+    total->slotCount = 0;
+    fclose(file);
+    return true;
+}
+
+bool RunCensus(const censusConfig* config, const char* filename) { // Soups 0 to soups - 1, counts written to filename
+    if (activeRule.states > 2) {
+        fprintf(stderr, "Error: the census needs a two-state rule\n");
+        return false;
+    }
+    if (config->soupSize < 1 || config->soupSize > config->fieldSize - 2 * CENSUS_MARGIN) {
+        fprintf(stderr, "Error: soups of %d cells don't fit a %d census field\n", config->soupSize, config->fieldSize);
+        return false;
+    }
+    bool ok = true;
+    for (int i = 0; i < pool.count; i++) ok = createCensusWorker(&censusWorkers[i], config) && ok;
+
+    uint64_t start = MonotonicNs(), printed = start;
+    unsigned long long done = 0;
+    unsigned long long batch = (unsigned long long)pool.count * CENSUS_BATCH;
+    while (ok && done < config->soups) {
+        unsigned long long count = config->soups - done < batch ? config->soups - done : batch;
+        censusJob job = {config, done};
+        RunBands(censusBand, &job, (int)count);
+        done += count;
+        for (int i = 0; i < pool.count; i++) ok = ok && !censusWorkers[i].failed;
+        if (MonotonicNs() - printed > 1000000000ull || done == config->soups) {
+            printed = MonotonicNs();
+            printf("Census: %llu of %llu soups, %.0f soups/s\n", done, config->soups, done / ((printed - start) / 1e9));
+        }
+    }
+
+    censusTable total = {0};
+    unsigned long long soups = 0, unstable = 0;
+    for (int i = 0; i < pool.count; i++) {
+        censusWorker* worker = &censusWorkers[i];
+        for (int k = 0; k < worker->table.count && ok; k++) {
+            ok = censusAdd(&total, worker->table.objects[k].code, worker->table.objects[k].count) >= 0;
+        }
+        soups += worker->soups;
+        unstable += worker->unstable;
+        freeCensusWorker(worker, config->fieldSize);
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: out of memory during the census\n");
+    } else if (!writeCensus(filename, config, &total, soups, unstable, (MonotonicNs() - start) / 1e9)) {
+        fprintf(stderr, "Error: cannot write %s\n", filename);
+        ok = false;
+    }
+    freeCensusTable(&total);
+    return ok;
+}
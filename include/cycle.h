@@ -0,0 +1,97 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Remembers the field hash of the last `window` generations and reports the first
+// generation whose hash was already seen, which means the field has become periodic.
+
+typedef struct cycleEntry {
+    uint64_t hash;
+    unsigned long long generation; // 0 marks an empty slot, generations are stored +1
+} cycleEntry;
+
+typedef struct cycleDetector {
+    int window;
+    int capacity;            // Power of two, at least four times the window
+    cycleEntry* table;
+    cycleEntry* recent;      // Ring of the last `window` entries, used to rebuild the table
+    unsigned long long inserted;
+    bool detected;
+    unsigned long long period;
+    unsigned long long since; // First generation of the cycle
+} cycleDetector;
+
+void CreateCycleDetector(cycleDetector* detector, int window) {
+    if (window < 1) window = 1;
+    int capacity = 4;
+    while (capacity < window * 4) capacity *= 2;
+    detector->window = window;
+    detector->capacity = capacity;
+    detector->table = (cycleEntry*)calloc(capacity, sizeof(cycleEntry));
+    detector->recent = (cycleEntry*)calloc(window, sizeof(cycleEntry));
+    detector->inserted = 0;
+    detector->detected = false;
+    detector->period = 0;
+    detector->since = 0;
+}
+
+void FreeCycleDetector(cycleDetector* detector) {
+    free(detector->table);
+    free(detector->recent);
+    detector->table = NULL;
+    detector->recent = NULL;
+}
+
+static void cyclePut(cycleDetector* detector, cycleEntry entry) {
+    int mask = detector->capacity - 1;
+    int slot = (int)(entry.hash & mask);
+    while (detector->table[slot].generation != 0 && detector->table[slot].hash != entry.hash) {
+        slot = (slot + 1) & mask;
+    }
+    detector->table[slot] = entry;
+}
+
+static cycleEntry* cycleFind(cycleDetector* detector, uint64_t hash) {
+    int mask = detector->capacity - 1;
+    int slot = (int)(hash & mask);
+    while (detector->table[slot].generation != 0) {
+        if (detector->table[slot].hash == hash) return &detector->table[slot];
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+void ResetCycleDetector(cycleDetector* detector) { // Call whenever the field is edited
+    memset(detector->table, 0, detector->capacity * sizeof(cycleEntry));
+    memset(detector->recent, 0, detector->window * sizeof(cycleEntry));
+    detector->inserted = 0;
+    detector->detected = false;
+    detector->period = 0;
+    detector->since = 0;
+}
+
+bool ObserveGeneration(cycleDetector* detector, unsigned long long generation, uint64_t hash) { // True once, when a repeat is first seen
+    if (detector->detected) return false;
+
+    cycleEntry* seen = cycleFind(detector, hash);
+    if (seen != NULL && generation + 1 - seen->generation <= (unsigned long long)detector->window) {
+        detector->detected = true;
+        detector->since = seen->generation - 1;
+        detector->period = generation - detector->since;
+        return true;
+    }
+
+    if (detector->inserted > 0 && detector->inserted % detector->window == 0) { // Drop entries that left the window
+        memset(detector->table, 0, detector->capacity * sizeof(cycleEntry));
+        for (int i = 0; i < detector->window; i++) {
+            if (detector->recent[i].generation != 0) cyclePut(detector, detector->recent[i]);
+        }
+    }
+    cycleEntry entry = {hash, generation + 1};
+    detector->recent[detector->inserted % detector->window] = entry;
+    cyclePut(detector, entry);
+    detector->inserted++;
+    return false;
+}
@@ -0,0 +1,280 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "threads.h"
+#include "bitslice.h"
+#include "cells.h"
+#include "cycle.h"
+#include "random.h"
+#include "rules.h"
+#include "topology.h"
+#include "trace.h"
+
+// Ensembles: many small independent universes in one process, for parameter sweeps.
+// Universe k runs rule k % rules from a random fill with seed + k / rules, so every rule
+// sees the same soups, until it repeats or hits the generation limit. A universe runs
+// start to finish on one worker in that worker's own fields, so only results are kept per
+// universe. Universes are batched into tasks of about ENSEMBLE_TASK_CELLS cell updates
+// and the tasks go through RunTasks, where workers that finish early steal from the rest;
+// universes settling at very different times keep every worker busy.
+//
+// When every rule fits bitslice.h, universes of one rule are instead stepped 64 at a time
+// in the lanes of a sliced field, one group of lanes per task. Each generation every lane
+// gets a hash of its cells and a cycle detector of its own, so a lane settles at the same
+// generation, with the same period and start, as it would stepped alone.
+
+#define ENSEMBLE_TASK_CELLS (1ull << 24)   // Cell updates a task aims for
+#define ENSEMBLE_TASKS_PER_WORKER 4        // Fewest tasks per worker, so there is something to steal
+
+typedef struct ensembleConfig {
+    int universes, size, history;
+    unsigned long long generations, seed;
+    double density;
+    const rule* rules;
+    int ruleCount;
+    bool sliced;                        // Step 64 universes at once when the rules allow it
+} ensembleConfig;
+
+typedef struct universeResult {
+    unsigned long long generations;     // Steps run
+    long long initial, population;
+    unsigned long long period, since;   // 0 when it never repeated
+    uint64_t hash;
+    uint64_t ns;
+} universeResult;
+
+typedef struct ensembleWorker {
+    bool** field[2];
+    cycleDetector cycles;
+    slicedField slices[2];              // Current and next, when stepping sliced
+    cycleDetector* laneCycles;          // One per lane, when stepping sliced
+} ensembleWorker;
+
+typedef struct ensembleJob {
+    const ensembleConfig* config;
+    universeResult* results;
+    int batch;                          // Universes per task
+} ensembleJob;
+
+static ensembleWorker ensembleWorkers[MAX_WORKERS];
+
+int ParseRules(const char* text, rule** out) { // Rules separated by ';' or line breaks, -1 after reporting a bad one
+    int count = 0, capacity = 0;
+    bool ok = true;
+    *out = NULL;
+    while (ok && *text != '\0') {
+        size_t length = strcspn(text, ";\r\n");
+        char name[RULE_NAME];
+        snprintf(name, sizeof(name), "%.*s", (int)(length < sizeof(name) ? length : sizeof(name) - 1), text);
+        text += length + (text[length] != '\0');
+        if (name[0] == '\0') continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            rule* grown = (rule*)realloc(*out, capacity * sizeof(rule));
+            ok = grown != NULL;
+            if (!ok) break;
+            *out = grown;
+        }
+        ok = ParseRule(name, &(*out)[count]);
+        if (!ok) fprintf(stderr, "Error: unknown rule %s\n", name);
+        count++;
+    }
+    if (ok) return count;
+    free(*out);
+    *out = NULL;
+    return -1;
+}
+
+static void runUniverse(ensembleWorker* worker, const ensembleConfig* config, int universe, universeResult* result, int index) {
+    int size = config->size;
+    uint64_t start = MonotonicNs();
+    const rule* rule = &config->rules[universe % config->ruleCount];
+    bool** current = worker->field[0];
+    bool** next = worker->field[1];
+    FillRandomAlone(current, 0, 0, size, size, config->density, config->seed + universe / config->ruleCount, index);
+    result->initial = result->population = CountField(current, size);
+    result->generations = result->period = result->since = 0;
+    result->hash = 0;
+    ResetCycleDetector(&worker->cycles);
+    for (unsigned long long generation = 1; generation <= config->generations; generation++) {
+        stepResult step = StepRule(rule, current, next, size, index);
+        bool** swap = current;
+        current = next;
+        next = swap;
+        result->generations = generation;
+        result->population = step.population;
+        result->hash = step.hash;
+        if (ObserveGeneration(&worker->cycles, generation, step.hash)) {
+            result->period = worker->cycles.period;
+            result->since = worker->cycles.since;
+            break;
+        }
+    }
+    result->ns = MonotonicNs() - start;
+}
+
+static void finishLane(ensembleWorker* worker, int lane, int size, universeResult* result) { // Final population and hash, as a scalar step reports them
+    ExtractUniverse(&worker->slices[0], lane, worker->field[0]);
+    result->population = 0;
+    result->hash = 0;
+    for (int i = 0; i < size; i++) result->hash += scanRow(worker->field[0][i], size, i, &result->population);
+}
+
+static void runGroup(ensembleWorker* worker, const ensembleConfig* config, int group, universeResult* results, int index) { // Up to 64 universes of one rule
+    int size = config->size, ruleIndex = group % config->ruleCount;
+    int first = group / config->ruleCount * SLICE_LANES; // Universe ruleIndex + ruleCount * (first + lane)
+    uint64_t start = MonotonicNs();
+    const rule* rule = &config->rules[ruleIndex];
+    uint64_t lanes = 0, settled = 0;
+    memset(worker->slices[0].cells, 0, worker->slices[0].stride * worker->slices[0].stride * sizeof(uint64_t));
+    for (int lane = 0; lane < SLICE_LANES; lane++) {
+        long long universe = ruleIndex + (long long)config->ruleCount * (first + lane);
+        if (universe >= config->universes) break;
+        FillRandomAlone(worker->field[0], 0, 0, size, size, config->density, config->seed + first + lane, index);
+        LoadUniverse(&worker->slices[0], lane, worker->field[0]);
+        universeResult* result = &results[universe];
+        result->initial = result->population = CountField(worker->field[0], size);
+        result->generations = result->period = result->since = 0;
+        result->hash = 0;
+        lanes |= 1ull << lane;
+    }
+    int count = __builtin_popcountll(lanes);
+
+    uint64_t hashes[SLICE_LANES];
+    for (int lane = 0; lane < SLICE_LANES; lane++) ResetCycleDetector(&worker->laneCycles[lane]);
+    unsigned long long generation = 1;
+    for (; generation <= config->generations && settled != lanes; generation++) {
+        StepSliced(rule, activeTopology, &worker->slices[0], &worker->slices[1]);
+        slicedField swap = worker->slices[0];
+        worker->slices[0] = worker->slices[1];
+        worker->slices[1] = swap;
+        LaneHashes(&worker->slices[0], hashes);
+        for (uint64_t open = lanes & ~settled; open != 0; open &= open - 1) {
+            int lane = __builtin_ctzll(open);
+            cycleDetector* cycles = &worker->laneCycles[lane];
+            if (!ObserveGeneration(cycles, generation, hashes[lane])) continue;
+            universeResult* result = &results[ruleIndex + config->ruleCount * (first + lane)];
+            result->generations = generation;
+            result->period = cycles->period;
+            result->since = cycles->since;
+            finishLane(worker, lane, size, result);
+            settled |= 1ull << lane;
+        }
+    }
+    for (uint64_t open = lanes & ~settled; open != 0; open &= open - 1) {
+        int lane = __builtin_ctzll(open);
+        universeResult* result = &results[ruleIndex + config->ruleCount * (first + lane)];
+        result->generations = generation - 1;
+        finishLane(worker, lane, size, result);
+    }
+    uint64_t ns = (MonotonicNs() - start) / (count ? count : 1);
+    for (uint64_t each = lanes; each != 0; each &= each - 1) {
+        results[ruleIndex + config->ruleCount * (first + __builtin_ctzll(each))].ns = ns;
+    }
+}
+
+static void slicedTask(void* arg, int task, int worker) {
+    ensembleJob* job = (ensembleJob*)arg;
+    TRACE_SCOPE("universes");
+    runGroup(&ensembleWorkers[worker], job->config, task, job->results, worker);
+}
+
+static void ensembleTask(void* arg, int task, int worker) {
+    ensembleJob* job = (ensembleJob*)arg;
+    TRACE_SCOPE("universes");
+    int first = task * job->batch;
+    int last = first + job->batch < job->config->universes ? first + job->batch : job->config->universes;
+    for (int k = first; k < last; k++) runUniverse(&ensembleWorkers[worker], job->config, k, &job->results[k], worker);
+}
+
+static int ensembleBatch(const ensembleConfig* config) {
+    unsigned long long cells = (unsigned long long)config->size * config->size * (config->generations ? config->generations : 1);
+    int batch = cells >= ENSEMBLE_TASK_CELLS ? 1 : (int)(ENSEMBLE_TASK_CELLS / cells);
+    int spread = config->universes / (pool.count * ENSEMBLE_TASKS_PER_WORKER);
+    if (batch > spread) batch = spread;
+    return batch < 1 ? 1 : batch;
+}
+
+static bool writeEnsemble(const char* filename, const ensembleConfig* config, const universeResult* results, int batch, bool sliced, double seconds) {
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) return false;
+    int repeating = 0;
+    for (int k = 0; k < config->universes; k++) repeating += results[k].period > 0;
+    fprintf(file, "# %d universes, %s %dx%d, density %.3g from seed %llu, up to %llu generations, %d per task%s, %.1f s\n",
+            config->universes, topologyNames[activeTopology], config->size, config->size, config->density, config->seed,
+            config->generations, batch, sliced ? " bit-sliced" : "", seconds);
+    fprintf(file, "# %d repeating\n", repeating);
+    fprintf(file, "# universe rule seed generations initial population period since hash ms\n");
+    for (int k = 0; k < config->universes; k++) {
+        const universeResult* result = &results[k];
+        fprintf(file, "%d %s %llu %llu %lld %lld %llu %llu %016llx %.3f\n", k, config->rules[k % config->ruleCount].name,
+                config->seed + k / config->ruleCount, result->generations, result->initial, result->population,
+                result->period, result->since, (unsigned long long)result->hash, result->ns / 1e6);
+    }
+    fclose(file);
+    return true;
+}
+
+bool RunEnsemble(const ensembleConfig* config, const char* filename) { // Results of every universe written to filename
+    for (int r = 0; r < config->ruleCount; r++) {
+        if (config->rules[r].states > 2) {
+            fprintf(stderr, "Error: ensembles need two-state rules, %s has %d states\n", config->rules[r].name, config->rules[r].states);
+            return false;
+        }
+    }
+    if (config->universes < 1 || config->ruleCount < 1 || config->size < 1) return false;
+    bool sliced = config->sliced;
+    for (int r = 0; r < config->ruleCount; r++) sliced = sliced && SlicedRule(&config->rules[r]);
+    buildCellSpread();
+    universeResult* results = (universeResult*)calloc(config->universes, sizeof(universeResult));
+    bool ok = results != NULL;
+    for (int i = 0; i < pool.count; i++) {
+        ensembleWorker* worker = &ensembleWorkers[i];
+        worker->field[0] = CreateField(config->size);
+        worker->field[1] = CreateField(config->size);
+        CreateCycleDetector(&worker->cycles, config->history);
+        ok = ok && worker->cycles.table != NULL && worker->cycles.recent != NULL;
+        for (int k = 0; k < 2 && sliced; k++) ok = CreateSlicedField(&worker->slices[k], config->size) && ok;
+        if (sliced) {
+            worker->laneCycles = (cycleDetector*)calloc(SLICE_LANES, sizeof(cycleDetector));
+            ok = ok && worker->laneCycles != NULL;
+            for (int lane = 0; lane < SLICE_LANES && worker->laneCycles != NULL; lane++) {
+                CreateCycleDetector(&worker->laneCycles[lane], config->history);
+                ok = ok && worker->laneCycles[lane].table != NULL && worker->laneCycles[lane].recent != NULL;
+            }
+        }
+    }
+
+    uint64_t start = MonotonicNs();
+    int batch = sliced ? SLICE_LANES : ensembleBatch(config);
+    if (ok) {
+        ensembleJob job = {config, results, batch};
+        int perRule = (config->universes + config->ruleCount - 1) / config->ruleCount;
+        if (sliced) RunTasks(slicedTask, &job, config->ruleCount * ((perRule + SLICE_LANES - 1) / SLICE_LANES));
+        else RunTasks(ensembleTask, &job, (config->universes + batch - 1) / batch);
+    }
+    double seconds = (MonotonicNs() - start) / 1e9;
+
+    for (int i = 0; i < pool.count; i++) {
+        FreeField(ensembleWorkers[i].field[0], config->size);
+        FreeField(ensembleWorkers[i].field[1], config->size);
+        FreeCycleDetector(&ensembleWorkers[i].cycles);
+        for (int k = 0; k < 2; k++) FreeSlicedField(&ensembleWorkers[i].slices[k]);
+        for (int lane = 0; lane < SLICE_LANES && ensembleWorkers[i].laneCycles != NULL; lane++) FreeCycleDetector(&ensembleWorkers[i].laneCycles[lane]);
+        free(ensembleWorkers[i].laneCycles);
+        memset(&ensembleWorkers[i], 0, sizeof(ensembleWorker));
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: out of memory for the ensemble\n");
+    } else if (!writeEnsemble(filename, config, results, batch, sliced, seconds)) {
+        fprintf(stderr, "Error: cannot write %s\n", filename);
+        ok = false;
+    } else {
+        printf("Ensemble: %d universes in %.2f s, %.0f universes/s\n", config->universes, seconds, config->universes / seconds);
+    }
+    free(results);
+    return ok;
+}
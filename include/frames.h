@@ -0,0 +1,202 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
+#include "threads.h"
+#include "cells.h"
+#include "stats.h"
+#include "trace.h"
+
+// Binary frame stream for headless runs. Every frame is a 32-byte frameHeader followed by
+// its payload, all little-endian. Cells are packed row by row, (size + 63) / 64 words per
+// row, cell j in bit j % 64 of word j / 64. A keyframe's payload is the packed field; a
+// delta frame's payload is a list of records against the previous frame, each one word
+// (low half: unchanged words skipped, high half: words that follow) and then the XOR of
+// those words. A frame only goes out as a delta when that is smaller, and every
+// keyEvery-th frame is a keyframe so readers can start anywhere. Small frames gather in
+// one large buffer and leave in a single write.
+
+#define FRAME_MAGIC 0x464c4f47u // "GOLF"
+#define FRAME_BUFFER (8 << 20)
+#define FRAME_FLUSH_NS 100000000ull // Readers on a pipe never wait longer than this for a frame
+
+typedef enum {
+    FRAME_KEY,
+    FRAME_DELTA,
+} frameKind;
+
+typedef struct frameHeader {
+    uint32_t magic;
+    uint8_t kind;
+    uint8_t reserved[3];
+    uint32_t size;        // Field width and height in cells
+    uint32_t payload;     // Bytes after the header
+    uint64_t generation;
+    int64_t population;
+} frameHeader;
+
+typedef struct frameStream {
+    FILE* file;
+    uint64_t* packed[2];  // The last frame and this one
+    uint64_t* delta;      // Never larger than a keyframe
+    char* buffer;
+    size_t used;
+    size_t rowWords;
+    int size;
+    unsigned long long frames, keyEvery;
+    uint64_t flushedNs;
+    bool failed;
+} frameStream;
+
+typedef struct packJob {
+    bool** field;
+    int size;
+    size_t rowWords;
+    uint64_t* out;
+} packJob;
+
+static void packRows(void* arg, int begin, int end, int worker) {
+    packJob* job = (packJob*)arg;
+    int size = job->size;
+    for (int i = begin; i < end; i++) {
+        const bool* row = job->field[i];
+        uint64_t* out = job->out + job->rowWords * i;
+        int j = 0;
+        for (; j + 64 <= size; j += 64) {
+            uint64_t word = 0;
+            for (int k = 0; k < 8; k++) {
+                word |= ((loadCells(row + j + k * 8) * 0x0102040810204080ull) >> 56) << (k * 8); // Gathers each byte's low bit
+            }
+            *out++ = word;
+        }
+        if (j < size) {
+            uint64_t word = 0;
+            for (int k = 0; j + k < size; k++) word |= (uint64_t)row[j + k] << k;
+            *out = word;
+        }
+    }
+}
+
+void PackField(bool** field, int size, uint64_t* out) { // Rows of (size + 63) / 64 words, cell j in bit j % 64 of word j / 64
+    packJob job = {field, size, ((size_t)size + 63) / 64, out};
+    RunBands(packRows, &job, size);
+}
+
+static size_t encodeDelta(const uint64_t* now, const uint64_t* before, size_t words, uint64_t* out, size_t limit) { // Payload words, limit when not smaller than that
+    size_t n = 0;
+    for (size_t i = 0; i < words;) {
+        size_t from = i;
+        while (i < words && now[i] == before[i]) i++;
+        if (i == words) break;
+        size_t start = i;
+        while (i < words && now[i] != before[i]) i++;
+        if (n + 1 + (i - start) >= limit) return limit;
+        out[n++] = (uint64_t)(start - from) | (uint64_t)(i - start) << 32;
+        for (size_t k = start; k < i; k++) out[n++] = now[k] ^ before[k];
+    }
+    return n;
+}
+
+static void frameFlush(frameStream* stream) {
+    if (stream->used > 0 && fwrite(stream->buffer, 1, stream->used, stream->file) != stream->used) stream->failed = true;
+    stream->used = 0;
+    stream->flushedNs = MonotonicNs();
+}
+
+static void framePut(frameStream* stream, const void* data, size_t length) {
+    if (length >= FRAME_BUFFER / 2) { // Large payloads go out as they are rather than through a copy
+        frameFlush(stream);
+        if (fwrite(data, 1, length, stream->file) != length) stream->failed = true;
+        return;
+    }
+    if (stream->used + length > FRAME_BUFFER) frameFlush(stream);
+    memcpy(stream->buffer + stream->used, data, length);
+    stream->used += length;
+}
+
+FILE* OpenBinaryOutput(const char* target) { // Unbuffered; "-" takes stdout over and moves printing to stderr
+    static bool stdoutTaken = false;
+    FILE* file = NULL;
+    if (strcmp(target, "-") == 0) {
+        if (stdoutTaken) return NULL;
+        fflush(stdout);
+        int fd = dup(fileno(stdout));
+        if (fd < 0 || dup2(fileno(stderr), fileno(stdout)) < 0) return NULL;
+#ifdef _WIN32
+        _setmode(fd, _O_BINARY);
+#endif
+        file = fdopen(fd, "wb");
+        stdoutTaken = file != NULL;
+    } else {
+        file = fopen(target, "wb"); // Also opens named pipes
+    }
+    if (file == NULL) return NULL;
+    setvbuf(file, NULL, _IONBF, 0); // Writers batch their own output
+#ifdef SIGPIPE
+    signal(SIGPIPE, SIG_IGN); // A reader going away ends the output instead of the process
+#endif
+    return file;
+}
+
+bool OpenFrameStream(frameStream* stream, const char* target, unsigned short size, unsigned long long keyEvery) { // "-" is stdout
+    memset(stream, 0, sizeof(*stream));
+    stream->file = OpenBinaryOutput(target);
+    if (stream->file == NULL) return false;
+
+    stream->size = size;
+    stream->rowWords = ((size_t)size + 63) / 64;
+    stream->keyEvery = keyEvery ? keyEvery : 1;
+    size_t bytes = stream->rowWords * size * sizeof(uint64_t);
+    stream->packed[0] = (uint64_t*)malloc(bytes);
+    stream->packed[1] = (uint64_t*)malloc(bytes);
+    stream->delta = (uint64_t*)malloc(bytes);
+    stream->buffer = (char*)malloc(FRAME_BUFFER);
+    stream->flushedNs = MonotonicNs();
+    return stream->packed[0] != NULL && stream->packed[1] != NULL && stream->delta != NULL && stream->buffer != NULL;
+}
+
+bool WriteFrame(frameStream* stream, bool** field, unsigned long long generation, long long population) { // False once the reader is gone
+    TRACE_SCOPE("WriteFrame");
+    PackField(field, stream->size, stream->packed[stream->frames & 1]);
+
+    size_t words = stream->rowWords * stream->size;
+    const uint64_t* now = stream->packed[stream->frames & 1];
+    const uint64_t* payload = now;
+    size_t payloadWords = words;
+    frameHeader header = {FRAME_MAGIC, FRAME_KEY, {0}, (uint32_t)stream->size, 0, generation, population};
+    if (stream->frames % stream->keyEvery != 0) {
+        size_t n = encodeDelta(now, stream->packed[(stream->frames + 1) & 1], words, stream->delta, words);
+        if (n < words) {
+            header.kind = FRAME_DELTA;
+            payload = stream->delta;
+            payloadWords = n;
+        }
+    }
+    header.payload = (uint32_t)(payloadWords * sizeof(uint64_t));
+    framePut(stream, &header, sizeof(header));
+    framePut(stream, payload, header.payload);
+    stream->frames++;
+    if (MonotonicNs() - stream->flushedNs > FRAME_FLUSH_NS) frameFlush(stream);
+    return !stream->failed;
+}
+
+void CloseFrameStream(frameStream* stream) {
+    if (stream->file != NULL) {
+        frameFlush(stream);
+        fclose(stream->file);
+    }
+    free(stream->packed[0]);
+    free(stream->packed[1]);
+    free(stream->delta);
+    free(stream->buffer);
+    memset(stream, 0, sizeof(*stream));
+}
@@ -0,0 +1,158 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "cells.h"
+#include "rules.h"
+#include "pages.h"
+
+// Generations rules (Brian's Brain B2/S/C3, Star Wars B2/S345/C4, ...): a live cell that
+// does not survive passes through states 2..C-1 before it is dead again, and only state 1
+// counts as a neighbour. States are packed two cells per byte; the bool field keeps
+// mirroring state 1 so the neighbour sums, population and editing work unchanged.
+
+typedef struct stateField {
+    unsigned char* cells;   // Row-major nibbles, the even column in the low half
+    size_t stride;
+    size_t mapped;
+} stateField;
+
+typedef struct generationsEngine {
+    stateField planes[2];
+    int current;
+    unsigned short size;
+    bool valid;                                  // Current plane matches the bool field
+    unsigned char table[MAX_STATES * 9];         // Next state indexed by state * 9 + live neighbours
+} generationsEngine;
+
+static generationsEngine generations;
+
+static inline unsigned char* stateRow(const stateField* plane, int i) {
+    return plane->cells + plane->stride * i;
+}
+
+static inline unsigned getNibble(const unsigned char* row, int j) {
+    return (row[j >> 1] >> ((j & 1) * 4)) & 15;
+}
+
+static inline void setNibble(unsigned char* row, int j, unsigned state) {
+    int shift = (j & 1) * 4;
+    row[j >> 1] = (unsigned char)((row[j >> 1] & ~(15 << shift)) | (state << shift));
+}
+
+void BuildGenerationsTable(const rule* rule) {
+    for (int state = 0; state < MAX_STATES; state++) {
+        for (int n = 0; n <= 8; n++) {
+            unsigned char next;
+            if (state == 0) next = (rule->birth >> n) & 1;
+            else if (state == 1) next = (rule->survive >> n) & 1 ? 1 : (rule->states > 2 ? 2 : 0);
+            else next = state + 1 < rule->states ? state + 1 : 0;
+            generations.table[state * 9 + n] = next;
+        }
+    }
+}
+
+static void allocStates(unsigned short size) {
+    if (generations.size == size && generations.planes[0].cells != NULL) return;
+    for (int p = 0; p < 2; p++) {
+        FreePages(generations.planes[p].cells, generations.planes[p].mapped);
+        generations.planes[p].stride = ((size_t)(size + 1) / 2 + 63) / 64 * 64;
+        generations.planes[p].cells = (unsigned char*)AllocPages(generations.planes[p].stride * size, &generations.planes[p].mapped);
+        if (generations.planes[p].cells == NULL) {
+            fprintf(stderr, "Error: cannot allocate %hux%hu state field\n", size, size);
+            exit(EXIT_FAILURE);
+        }
+    }
+    generations.size = size;
+    generations.current = 0;
+}
+
+void SyncStates(bool** field, unsigned short size) { // Rebuilds states from the bool field, dying cells are lost
+    allocStates(size);
+    stateField* plane = &generations.planes[generations.current];
+    for (int i = 0; i < size; i++) {
+        unsigned char* row = stateRow(plane, i);
+        memset(row, 0, plane->stride);
+        for (int j = 0; j < size; j++) {
+            if (field[i][j]) setNibble(row, j, 1);
+        }
+    }
+    generations.valid = true;
+}
+
+void InvalidateStates(void) {
+    generations.valid = false;
+}
+
+unsigned CellState(int i, int j) {
+    return getNibble(stateRow(&generations.planes[generations.current], i), j);
+}
+
+void SetCellState(int i, int j, unsigned state) { // Only meaningful while the states are valid
+    if (generations.valid) setNibble(stateRow(&generations.planes[generations.current], i), j, state);
+}
+
+unsigned char* StateRow(int i) { // Row of the current plane, (size + 1) / 2 bytes
+    return stateRow(&generations.planes[generations.current], i);
+}
+
+uint64_t HashStates(unsigned short size) {
+    uint64_t hash = 0;
+    for (int i = 0; i < size; i++) {
+        hash += hashBytes(StateRow(i), (size + 1) / 2, i);
+    }
+    return hash;
+}
+
+uint64_t StepGenerationRows(neighbourhoodKind kind, bool** current, bool** next, int size, int begin, int end, long long* population) {
+    const stateField* from = &generations.planes[generations.current];
+    const stateField* to = &generations.planes[1 - generations.current];
+    bool quiet = generations.table[0] == 0;
+    int bytes = (size + 1) / 2;
+    uint64_t hash = 0;
+
+    for (int i = begin; i < end; i++) {
+        const bool* up = current[i - 1];
+        const bool* mid = current[i];
+        const bool* down = current[i + 1];
+        const unsigned char* states = stateRow(from, i);
+        unsigned char* nextStates = stateRow(to, i);
+        bool* row = next[i];
+        int offset = i & 1 ? 0 : -1; // Hex rows, see neighbourWord
+
+        int j = 0;
+        for (; j + 8 <= size; j += 8) { // Eight cells: one word of neighbour sums, four bytes of states
+            unsigned char counts[8];
+            uint64_t sum = neighbourWord(kind, up, mid, down, j, offset);
+            uint32_t packed;
+            memcpy(&packed, states + j / 2, sizeof(packed));
+            if (quiet && sum == 0 && packed == 0) {
+                memset(nextStates + j / 2, 0, 4);
+                memset(row + j, 0, 8);
+                continue;
+            }
+            memcpy(counts, &sum, sizeof(counts));
+            for (int k = 0; k < 8; k += 2) {
+                unsigned char pair = states[(j + k) / 2];
+                unsigned char low = generations.table[(pair & 15) * 9 + counts[k]];
+                unsigned char high = generations.table[(pair >> 4) * 9 + counts[k + 1]];
+                nextStates[(j + k) / 2] = (unsigned char)(low | high << 4);
+                row[j + k] = low == 1;
+                row[j + k + 1] = high == 1;
+            }
+        }
+        for (; j < size; j++) {
+            unsigned char state = generations.table[getNibble(states, j) * 9 + neighbourCount(kind, up, mid, down, j, offset)];
+            setNibble(nextStates, j, state);
+            row[j] = state == 1;
+        }
+
+        *population += CountRow(row, size);
+        hash += hashBytes(nextStates, bytes, i);
+    }
+    return hash;
+}
+
+void SwapStates(void) {
+    generations.current = 1 - generations.current;
+}
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define JSON_WORD 64
+
 typedef struct jsonPair{
     char* key;
     char* value;
@@ -46,7 +48,6 @@ returnPair ParseJson(char* data){
     }
     size /= 4; //array size
 
-    char word[10];
     jsonPair* arr = (jsonPair*)malloc(size * sizeof(jsonPair));
 
     int index = 0;
@@ -55,10 +56,11 @@ returnPair ParseJson(char* data){
         if (*data == '\0') break;
         data++;
 
-        char word[10];
+        char word[JSON_WORD];
         int i = 0;
         while (*data != '"' && *data != '\0') {
-            word[i++] = *data++;
+            if (i < JSON_WORD - 1) word[i++] = *data;
+            data++;
         }
         word[i] = '\0';
         data++;
@@ -71,7 +73,8 @@ returnPair ParseJson(char* data){
 
         i = 0;
         while (*data != '"' && *data != '\0') {
-            word[i++] = *data++;
+            if (i < JSON_WORD - 1) word[i++] = *data;
+            data++;
         }
         word[i] = '\0';
         data++;
@@ -0,0 +1,326 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "threads.h"
+#include "cells.h"
+#include "topology.h"
+#include "trace.h"
+
+// Connected-component labelling on packed fields (rows of (size + 63) / 64 words, as
+// PackField writes them). Cells within gap of each other in both directions belong to
+// the same component, so gap 1 is 8-connectivity. Each row is cut into runs of live cells
+// (runs closer than the gap are joined), and runs within reach of each other are merged
+// with a union-find whose roots only ever link to a smaller run index. That makes the
+// merge lock-free (a link is one compare-and-swap on a root) and lets every band merge
+// its rows against the rows above, across band boundaries and the torus edge, in one
+// parallel pass. The root of every component is then its first run in row order, so
+// components come out numbered top to bottom whatever the number of workers.
+
+typedef struct labelRun {
+    int row, start, end;            // end is the last cell of the run
+} labelRun;
+
+typedef struct component {
+    int left, top, width, height;   // Objects across a torus edge start at negative left or top
+    long long population;
+    uint64_t hash;                  // The same for the same cells anywhere on the field
+    int firstRun, runCount;         // Its runs in labeller.order, top to bottom
+} component;
+
+typedef struct labeller {
+    const uint64_t* packed;
+    int size, gap;
+    size_t rowWords;
+    bool wrap;                      // Rows and columns wrap around, as on a torus
+    int* rowRuns;                   // Runs in each row, then where each row's runs start
+    int* rowFirst;
+    int rowCapacity;
+    labelRun* runs;
+    _Atomic int* parent;
+    int* runComponent;
+    int* order;                     // Run indices grouped by component
+    int runCount, runCapacity;
+    component* components;
+    int componentCount, componentCapacity;
+} labeller;
+
+static bool nextRun(const uint64_t* row, size_t rowWords, int from, int* start, int* end) { // First run at or after from
+    size_t w = (size_t)from >> 6;
+    if (w >= rowWords) return false;
+    uint64_t bits = row[w] & (~0ull << (from & 63));
+    while (bits == 0) {
+        if (++w == rowWords) return false;
+        bits = row[w];
+    }
+    *start = (int)(w * 64) + __builtin_ctzll(bits);
+    uint64_t holes = ~row[w] & (~0ull << (*start & 63));
+    while (holes == 0) {
+        if (++w == rowWords) {
+            *end = (int)(w * 64) - 1;
+            return true;
+        }
+        holes = ~row[w];
+    }
+    *end = (int)(w * 64) + __builtin_ctzll(holes) - 1;
+    return true;
+}
+
+static bool nextGroup(const labeller* labels, const uint64_t* row, int from, int* start, int* end) { // Runs closer than the gap count as one
+    if (!nextRun(row, labels->rowWords, from, start, end)) return false;
+    int nextStart, nextEnd;
+    while (labels->gap > 1 && nextRun(row, labels->rowWords, *end + 1, &nextStart, &nextEnd) && nextStart - *end <= labels->gap) {
+        *end = nextEnd;
+    }
+    return true;
+}
+
+static void countRuns(void* arg, int begin, int end, int worker) {
+    labeller* labels = (labeller*)arg;
+    for (int i = begin; i < end; i++) {
+        const uint64_t* row = labels->packed + labels->rowWords * i;
+        int count = 0, start, last = -1;
+        while (nextGroup(labels, row, last + 1, &start, &last)) count++;
+        labels->rowRuns[i] = count;
+    }
+}
+
+static void fillRuns(void* arg, int begin, int end, int worker) {
+    labeller* labels = (labeller*)arg;
+    for (int i = begin; i < end; i++) {
+        const uint64_t* row = labels->packed + labels->rowWords * i;
+        int index = labels->rowFirst[i], start, last = -1;
+        while (nextGroup(labels, row, last + 1, &start, &last)) {
+            labels->runs[index].row = i;
+            labels->runs[index].start = start;
+            labels->runs[index].end = last;
+            atomic_store_explicit(&labels->parent[index], index, memory_order_relaxed);
+            index++;
+        }
+    }
+}
+
+static int findRoot(_Atomic int* parent, int x) { // Halves the path on the way
+    while (true) {
+        int up = atomic_load_explicit(&parent[x], memory_order_relaxed);
+        if (up == x) return x;
+        int above = atomic_load_explicit(&parent[up], memory_order_relaxed);
+        if (above != up) atomic_compare_exchange_weak_explicit(&parent[x], &up, above, memory_order_relaxed, memory_order_relaxed);
+        x = above;
+    }
+}
+
+static void unite(_Atomic int* parent, int a, int b) { // The larger root links to the smaller, retried if another worker got there first
+    while (true) {
+        a = findRoot(parent, a);
+        b = findRoot(parent, b);
+        if (a == b) return;
+        if (a < b) {
+            int swap = a;
+            a = b;
+            b = swap;
+        }
+        int expected = a;
+        if (atomic_compare_exchange_strong_explicit(&parent[a], &expected, b, memory_order_relaxed, memory_order_relaxed)) return;
+    }
+}
+
+static void linkRows(labeller* labels, int rowA, int rowB) { // Merges runs of two rows that are within the gap
+    const labelRun* runs = labels->runs;
+    int gap = labels->gap, size = labels->size;
+    int firstA = labels->rowFirst[rowA], endA = firstA + labels->rowRuns[rowA];
+    int firstB = labels->rowFirst[rowB], endB = firstB + labels->rowRuns[rowB];
+    if (firstA == endA || firstB == endB) return;
+
+    if (rowA != rowB) {
+        for (int i = firstA, j = firstB; i < endA && j < endB;) {
+            if (runs[i].end + gap < runs[j].start) {
+                i++;
+            } else if (runs[j].end + gap < runs[i].start) {
+                j++;
+            } else {
+                unite(labels->parent, i, j);
+                if (runs[i].end < runs[j].end) i++; else j++;
+            }
+        }
+    }
+    if (!labels->wrap) return;
+    for (int pass = 0; pass < 2; pass++) { // Left edge runs of one row against right edge runs of the other
+        int left = pass ? firstB : firstA, leftEnd = pass ? endB : endA;
+        int rightFirst = pass ? firstA : firstB, right = pass ? endA : endB;
+        for (int i = left; i < leftEnd && runs[i].start < gap; i++) {
+            for (int j = right - 1; j >= rightFirst && runs[j].end >= size - gap; j--) {
+                if (runs[i].start + size - runs[j].end <= gap) unite(labels->parent, i, j);
+            }
+        }
+    }
+}
+
+static void linkBand(void* arg, int begin, int end, int worker) {
+    labeller* labels = (labeller*)arg;
+    for (int i = begin; i < end; i++) {
+        linkRows(labels, i, i);
+        for (int d = 1; d <= labels->gap; d++) {
+            int above = i - d;
+            if (above < 0) {
+                if (!labels->wrap) break;
+                above = ((above % labels->size) + labels->size) % labels->size;
+            }
+            linkRows(labels, i, above);
+        }
+    }
+}
+
+static bool labelReserve(labeller* labels, int size, int runs) {
+    if (size > labels->rowCapacity) {
+        int* rowRuns = (int*)realloc(labels->rowRuns, size * sizeof(int));
+        if (rowRuns != NULL) labels->rowRuns = rowRuns;
+        int* rowFirst = (int*)realloc(labels->rowFirst, (size + 1) * sizeof(int));
+        if (rowFirst != NULL) labels->rowFirst = rowFirst;
+        if (rowRuns == NULL || rowFirst == NULL) return false;
+        labels->rowCapacity = size;
+    }
+    if (runs > labels->runCapacity) {
+        int capacity = labels->runCapacity ? labels->runCapacity : 1024;
+        while (capacity < runs) capacity *= 2;
+        free(labels->runs);
+        free((void*)labels->parent);
+        free(labels->runComponent);
+        free(labels->order);
+        labels->runs = (labelRun*)malloc(capacity * sizeof(labelRun));
+        labels->parent = (_Atomic int*)malloc(capacity * sizeof(_Atomic int));
+        labels->runComponent = (int*)malloc(capacity * sizeof(int));
+        labels->order = (int*)malloc(capacity * sizeof(int));
+        labels->runCapacity = capacity;
+        if (labels->runs == NULL || labels->parent == NULL || labels->runComponent == NULL || labels->order == NULL) {
+            labels->runCapacity = 0;
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64_t runBits(const uint64_t* row, int start, int length) { // length (1..64) cells from start
+    int offset = start & 63;
+    const uint64_t* word = row + (start >> 6);
+    uint64_t bits = word[0] >> offset;
+    if (offset + length > 64) bits |= word[1] << (64 - offset);
+    return length == 64 ? bits : bits & ((1ull << length) - 1);
+}
+
+static void measureBand(void* arg, int begin, int end, int worker) { // Boxes, populations and hashes, choosing for each axis whether the box is smaller across the torus edge
+    labeller* labels = (labeller*)arg;
+    int size = labels->size, half = size / 2;
+    for (int c = begin; c < end; c++) {
+        component* object = &labels->components[c];
+        int top = size, bottom = -1, left = size, right = -1;
+        int shiftedTop = size, shiftedBottom = -1, shiftedLeft = size, shiftedRight = -1;
+        bool split = false; // A run crosses the middle column, so the shifted box doesn't hold it
+        object->population = 0;
+        for (int k = object->firstRun; k < object->firstRun + object->runCount; k++) {
+            const labelRun* run = &labels->runs[labels->order[k]];
+            int row = wrapIndex(run->row + half, size), start = wrapIndex(run->start + half, size), last = wrapIndex(run->end + half, size);
+            if (run->row < top) top = run->row;
+            if (run->row > bottom) bottom = run->row;
+            if (run->start < left) left = run->start;
+            if (run->end > right) right = run->end;
+            if (row < shiftedTop) shiftedTop = row;
+            if (row > shiftedBottom) shiftedBottom = row;
+            if (start > last) split = true;
+            if (start < shiftedLeft) shiftedLeft = start;
+            if (last > shiftedRight) shiftedRight = last;
+        }
+        object->top = top;
+        object->height = bottom - top + 1;
+        object->left = left;
+        object->width = right - left + 1;
+        if (labels->wrap && shiftedBottom - shiftedTop + 1 < object->height) {
+            object->top = shiftedTop - half;
+            object->height = shiftedBottom - shiftedTop + 1;
+        }
+        if (labels->wrap && !split && shiftedRight - shiftedLeft + 1 < object->width) {
+            object->left = shiftedLeft - half;
+            object->width = shiftedRight - shiftedLeft + 1;
+        }
+
+        uint64_t hash = 0; // A sum over cells, so neither run order nor where the torus edge cuts runs matters
+        for (int k = object->firstRun; k < object->firstRun + object->runCount; k++) {
+            const labelRun* run = &labels->runs[labels->order[k]];
+            const uint64_t* bits = labels->packed + labels->rowWords * run->row;
+            uint64_t row = (uint64_t)(wrapIndex(run->row - object->top, size) + 1) << 32; // From 1, since mixHash(0) is 0 and would drop the corner cell
+            for (int j = run->start; j <= run->end; j += 64) {
+                uint64_t live = runBits(bits, j, run->end - j + 1 < 64 ? run->end - j + 1 : 64);
+                object->population += __builtin_popcountll(live);
+                for (; live != 0; live &= live - 1) {
+                    hash += mixHash(row | (uint64_t)wrapIndex(j + __builtin_ctzll(live) - object->left, size));
+                }
+            }
+        }
+        object->hash = mixHash(hash);
+    }
+}
+
+int LabelPacked(labeller* labels, const uint64_t* packed, int size, int gap, bool wrap, bool parallel) { // Components, -1 when out of memory; parallel uses the worker pool
+    TRACE_SCOPE("LabelPacked");
+    labels->packed = packed;
+    labels->size = size;
+    labels->gap = gap < 1 ? 1 : gap;
+    labels->rowWords = ((size_t)size + 63) / 64;
+    labels->wrap = wrap;
+    labels->componentCount = 0;
+    if (!labelReserve(labels, size, 0)) return -1;
+
+    if (parallel) RunBands(countRuns, labels, size); else countRuns(labels, 0, size, 0);
+    int total = 0;
+    for (int i = 0; i < size; i++) {
+        labels->rowFirst[i] = total;
+        total += labels->rowRuns[i];
+    }
+    labels->rowFirst[size] = total;
+    labels->runCount = total;
+    if (!labelReserve(labels, size, total)) return -1;
+    if (parallel) RunBands(fillRuns, labels, size); else fillRuns(labels, 0, size, 0);
+    if (parallel) RunBands(linkBand, labels, size); else linkBand(labels, 0, size, 0);
+
+    int count = 0;
+    for (int i = 0; i < total; i++) { // A root is its component's first run, so it is numbered before the rest
+        int root = findRoot(labels->parent, i);
+        labels->runComponent[i] = root == i ? count++ : labels->runComponent[root];
+    }
+    if (count > labels->componentCapacity) {
+        int capacity = labels->componentCapacity ? labels->componentCapacity : 256;
+        while (capacity < count) capacity *= 2;
+        component* grown = (component*)realloc(labels->components, capacity * sizeof(component));
+        if (grown == NULL) return -1;
+        labels->components = grown;
+        labels->componentCapacity = capacity;
+    }
+    labels->componentCount = count;
+    for (int c = 0; c < count; c++) labels->components[c].runCount = 0;
+    for (int i = 0; i < total; i++) labels->components[labels->runComponent[i]].runCount++;
+    int first = 0;
+    for (int c = 0; c < count; c++) {
+        labels->components[c].firstRun = first;
+        first += labels->components[c].runCount;
+        labels->components[c].runCount = 0;
+    }
+    for (int i = 0; i < total; i++) { // Counting sort, rows stay in order within a component
+        component* object = &labels->components[labels->runComponent[i]];
+        labels->order[object->firstRun + object->runCount++] = i;
+    }
+    if (parallel) RunBands(measureBand, labels, count); else measureBand(labels, 0, count, 0);
+    return count;
+}
+
+void FreeLabeller(labeller* labels) {
+    free(labels->rowRuns);
+    free(labels->rowFirst);
+    free(labels->runs);
+    free((void*)labels->parent);
+    free(labels->runComponent);
+    free(labels->order);
+    free(labels->components);
+    memset(labels, 0, sizeof(*labels));
+}
@@ -1,63 +1,299 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#include "threads.h"
+#include "cells.h"
+#include "rules.h"
+#include "block.h"
+#include "generations.h"
+#include "ltl.h"
+#include "topology.h"
 
-bool** CreateField(const unsigned short size) {
-    bool** field = (bool**)malloc(size * sizeof(bool*));
-    for (int i = 0; i < size; i++) {
-        field[i] = (bool*)malloc(size * sizeof(bool));
-        for (int j = 0; j < size; j++) {
-            field[i][j] = 0;
-        }
+#define FIELD_HEADER 64 // Keeps rows cache-line aligned behind the block header
+#define FIELD_LEAD 64   // Bytes before each row's first cell, the last one is the left halo cell
+
+typedef enum {
+    ENGINE_CELL,   // Word-wide neighbour sums, one table lookup per cell
+    ENGINE_BLOCK,  // 4x4 -> 2x2 block table, one lookup per four cells
+    ENGINE_COUNT,
+} stepEngine;
+
+const char* engineNames[ENGINE_COUNT] = {"cell", "block"};
+stepEngine activeEngine = ENGINE_CELL;
+
+stepEngine ParseEngine(const char* value) {
+    for (int i = 0; i < ENGINE_COUNT; i++) {
+        if (strcmp(value, engineNames[i]) == 0) return (stepEngine)i;
+    }
+    return ENGINE_CELL;
+}
+
+typedef struct fieldBlock {
+    size_t mapped;
+    size_t stride;
+} fieldBlock;
+
+typedef struct stepResult {
+    long long population;
+    uint64_t hash;  // Order-independent sum of row hashes, so bands can add theirs
+} stepResult;
+
+typedef struct stepArgs {
+    bool** current;
+    bool** next;
+    unsigned short size;
+    const rule* rule;
+    stepResult band[MAX_WORKERS];
+} stepArgs;
+
+static fieldBlock* fieldHeader(bool** field) { // Rows -1 and size are the halo rows
+    return (fieldBlock*)((char*)field[-1] - FIELD_LEAD - FIELD_HEADER);
+}
+
+static void touchRows(void* arg, int begin, int end, int worker) {
+    bool** field = (bool**)arg;
+    size_t stride = fieldHeader(field)->stride;
+    memset((char*)field[begin] - FIELD_LEAD, 0, stride * (end - begin));
+}
+
+bool** CreateField(const unsigned short size) { // Rows share one block so huge pages and node placement cover them
+    size_t stride = FIELD_LEAD + ((size_t)size + 2 + 63) / 64 * 64; // Right halo cell and one spare column for the block engine
+    size_t mapped = 0;
+    char* block = (char*)AllocPages(FIELD_HEADER + stride * (size + 2), &mapped);
+    bool** rows = (bool**)malloc((size + 2) * sizeof(bool*));
+    if (block == NULL || rows == NULL) {
+        fprintf(stderr, "Error: cannot allocate %hux%hu field\n", size, size);
+        exit(EXIT_FAILURE);
+    }
+
+    fieldBlock* header = (fieldBlock*)block;
+    header->mapped = mapped;
+    header->stride = stride;
+    for (int i = 0; i < size + 2; i++) {
+        rows[i] = (bool*)(block + FIELD_HEADER + stride * i + FIELD_LEAD);
     }
+
+    bool** field = rows + 1;
+    if (placement == PLACEMENT_FIRST_TOUCH) {
+        RunBands(touchRows, field, size);
+    } else {
+        touchRows(field, 0, size, 0);
+    }
+    touchRows(field, -1, 0, 0);
+    touchRows(field, size, size + 1, 0);
     return field;
 }
 
-void NextStep(bool** current, bool** next, const unsigned short size ) {
+int FieldPerNode(bool** field, size_t* perNode) {
+    fieldBlock* header = fieldHeader(field);
+    return PagesPerNode(header, header->mapped, perNode);
+}
+
+long long CountField(bool** field, const unsigned short size) {
+    long long count = 0;
+    for (int i = 0; i < size; i++) {
+        count += CountRow(field[i], size);
+    }
+    return count;
+}
+
+uint64_t HashField(bool** field, const unsigned short size) { // Same hash NextStep reports for this field
+    if (activeRule.states > 2) {
+        if (!generations.valid) SyncStates(field, size);
+        return HashStates(size);
+    }
+    uint64_t hash = 0;
+    long long population = 0;
     for (int i = 0; i < size; i++) {
-        for (int j = 0; j < size; j++) {
-            if (current[i][j] == 0) {
-                int all_dead = 1;
-                for (int di = -1; di <= 1 && all_dead; di++) {
-                    for (int dj = -1; dj <= 1 && all_dead; dj++) {
-                        if (di == 0 && dj == 0) continue;
-                        int ni = (i + di + size) % size;
-                        int nj = (j + dj + size) % size;
-                        if (current[ni][nj] != 0) {
-                            all_dead = 0;
-                            break;
-                        }
-                    }
-                }
-                if (all_dead) {
-                    next[i][j] = 0;
-                    continue;
-                }
+        hash += scanRow(field[i], size, i, &population);
+    }
+    return hash;
+}
+
+static void stepRows(void* arg, int begin, int end, int worker) {
+    bool** current = ((stepArgs*)arg)->current;
+    bool** next = ((stepArgs*)arg)->next;
+    int size = ((stepArgs*)arg)->size;
+    const rule* rule = ((stepArgs*)arg)->rule;
+    neighbourhoodKind kind = (neighbourhoodKind)rule->neighbourhood;
+    bool quiet = (rule->birth & 1) == 0; // Without B0 an empty neighbourhood stays empty
+    long long population = 0;
+    uint64_t hash = 0;
+
+    for (int i = begin; i < end; i++) {
+        const bool* up = current[i - 1];
+        const bool* mid = current[i];
+        const bool* down = current[i + 1];
+        bool* row = next[i];
+        int offset = i & 1 ? 0 : -1; // Hex rows, see neighbourWord
+
+        int j = 0;
+        for (; j + 8 <= size; j += 8) { // Cells are 0/1 bytes, so eight neighbour counts add up in one word
+            uint64_t index = neighbourWord(kind, up, mid, down, j, offset) + loadCells(mid + j) * 9;
+            if (quiet && index == 0) {
+                memset(row + j, 0, 8);
+                continue;
             }
-            int neighbors = 0;
-            for (int di = -1; di <= 1; di++) {
-                for (int dj = -1; dj <= 1; dj++) {
-                    if (di == 0 && dj == 0) continue;
-                    int ni = (i + di + size) % size;
-                    int nj = (j + dj + size) % size;
-                    neighbors += current[ni][nj];
-                }
+            unsigned char lanes[8];
+            memcpy(lanes, &index, sizeof(lanes));
+            for (int k = 0; k < 8; k++) {
+                row[j + k] = rule->next[lanes[k]];
             }
+        }
+        for (; j < size; j++) {
+            row[j] = rule->next[mid[j] * 9 + neighbourCount(kind, up, mid, down, j, offset)];
+        }
+        hash += scanRow(row, size, i, &population);
+    }
+    ((stepArgs*)arg)->band[worker].population = population;
+    ((stepArgs*)arg)->band[worker].hash = hash;
+}
+
+static inline unsigned columnAt(const bool* up, const bool* mid, const bool* down, int j) {
+    return up[j] | mid[j] << 1 | down[j] << 2;
+}
+
+static void stepIsotropicRows(void* arg, int begin, int end, int worker) { // Hensel rules: one 9-bit table index per cell
+    bool** current = ((stepArgs*)arg)->current;
+    bool** next = ((stepArgs*)arg)->next;
+    int size = ((stepArgs*)arg)->size;
+    const unsigned char* table = ((stepArgs*)arg)->rule->table;
+    bool quiet = table[0] == 0;
+    long long population = 0;
+    uint64_t hash = 0;
+
+    for (int i = begin; i < end; i++) {
+        const bool* up = current[i - 1];
+        const bool* mid = current[i];
+        const bool* down = current[i + 1];
+        bool* row = next[i];
 
-            if (current[i][j]) {
-                next[i][j] = (neighbors == 2 || neighbors == 3) ? 1 : 0;
-            } else {
-                next[i][j] = (neighbors == 3) ? 1 : 0;
+        // Columns j-1 and j in bits 0-5, each one up | mid << 1 | down << 2. The index is
+        // the transposed 3x3 neighbourhood, which an isotropic table maps the same way.
+        unsigned index = columnAt(up, mid, down, -1) | columnAt(up, mid, down, 0) << 3;
+        int j = 0;
+        for (; j + 8 <= size; j += 8) { // Eight column codes of j+1..j+8 built a word at a time
+            uint64_t columns = loadCells(up + j + 1) | loadCells(mid + j + 1) << 1 | loadCells(down + j + 1) << 2;
+            if (quiet && columns == 0 && index == 0) {
+                memset(row + j, 0, 8);
+                continue;
             }
+            for (int k = 0; k < 8; k++) {
+                index |= (unsigned)((columns >> (k * 8)) & 7) << 6;
+                row[j + k] = table[index];
+                index >>= 3;
+            }
+        }
+        for (; j < size; j++) {
+            index |= columnAt(up, mid, down, j + 1) << 6;
+            row[j] = table[index];
+            index >>= 3;
         }
+        hash += scanRow(row, size, i, &population);
     }
+    ((stepArgs*)arg)->band[worker].population = population;
+    ((stepArgs*)arg)->band[worker].hash = hash;
 }
 
-void FreeField(bool** field, const unsigned short size) {
-    for (int i = 0; i < size; i++) {
-        free(field[i]);
+static void stepBlockBand(void* arg, int begin, int end, int worker) { // Bands are counted in row pairs
+    bool** next = ((stepArgs*)arg)->next;
+    int size = ((stepArgs*)arg)->size;
+    long long population = 0;
+    uint64_t hash = 0;
+
+    StepBlockRows(((stepArgs*)arg)->current, next, size, begin * 2, end * 2);
+    for (int i = begin * 2; i < end * 2 && i < size; i++) {
+        hash += scanRow(next[i], size, i, &population);
+    }
+    ((stepArgs*)arg)->band[worker].population = population;
+    ((stepArgs*)arg)->band[worker].hash = hash;
+}
+
+static void stepGenerationsBand(void* arg, int begin, int end, int worker) {
+    stepArgs* args = (stepArgs*)arg;
+    long long population = 0;
+    args->band[worker].hash = StepGenerationRows((neighbourhoodKind)args->rule->neighbourhood, args->current, args->next, args->size, begin, end, &population);
+    args->band[worker].population = population;
+}
+
+static void stepLargerBand(void* arg, int begin, int end, int worker) {
+    stepArgs* args = (stepArgs*)arg;
+    long long population = 0;
+    args->band[worker].hash = StepLargerRows(args->rule, activeTopology == TOPOLOGY_PLANE, args->current, args->next, args->size, begin, end, worker, &population);
+    args->band[worker].population = population;
+}
+
+stepResult NextStep(bool** current, bool** next, const unsigned short size) { // Population and hash of the new generation
+    stepArgs args = {current, next, size, &activeRule, {{0}}};
+    FillHalo(current, size, activeTopology);
+    if (activeRule.states > 2) {
+        BuildGenerationsTable(&activeRule);
+        if (!generations.valid) SyncStates(current, size);
+        RunBands(stepGenerationsBand, &args, size);
+        SwapStates();
+    } else if (activeRule.range > 1) {
+        RunBands(stepLargerBand, &args, size);
+    } else if (activeEngine == ENGINE_BLOCK) {
+        PrepareBlockTable(&activeRule);
+        RunBands(stepBlockBand, &args, (size + 1) / 2);
+    } else if (activeRule.nonTotalistic) {
+        RunBands(stepIsotropicRows, &args, size);
+    } else {
+        RunBands(stepRows, &args, size);
     }
-    free(field);
+    if (activeRule.states <= 2) InvalidateStates();
+
+    stepResult result = {0, 0};
+    for (int i = 0; i < pool.count; i++) {
+        result.population += args.band[i].population;
+        result.hash += args.band[i].hash;
+    }
+    return result;
+}
+
+static bandFunc ruleKernel(const rule* rule) { // Band kernel of a two-state rule
+    return rule->range > 1 ? stepLargerBand : rule->nonTotalistic ? stepIsotropicRows : stepRows;
+}
+
+stepResult StepRule(const rule* rule, bool** current, bool** next, const unsigned short size, int worker) { // NextStep on the calling worker only, for fields a worker owns; two-state rules
+    stepArgs args = {current, next, size, rule, {{0}}};
+    FillHalo(current, size, activeTopology);
+    ruleKernel(rule)(&args, 0, size, worker);
+    return args.band[worker];
+}
+
+typedef struct rowsArgs {
+    stepArgs step;
+    bandFunc kernel;
+    int first;
+} rowsArgs;
+
+static void stepOffsetRows(void* arg, int begin, int end, int worker) {
+    rowsArgs* args = (rowsArgs*)arg;
+    args->kernel(&args->step, args->first + begin, args->first + end, worker);
+}
+
+stepResult StepRows(const rule* rule, bool** current, bool** next, const unsigned short size, int first, int count) { // Rows first..first+count-1 on all workers, for fields held in parts; the caller fills the halo and the rows the rule reaches; two-state rules
+    rowsArgs args = {{current, next, size, rule, {{0}}}, ruleKernel(rule), first};
+    RunBands(stepOffsetRows, &args, count);
+    stepResult result = {0, 0};
+    for (int i = 0; i < pool.count; i++) {
+        result.population += args.step.band[i].population;
+        result.hash += args.step.band[i].hash;
+    }
+    return result;
+}
+
+stepResult StepAlone(bool** current, bool** next, const unsigned short size, int worker) {
+    return StepRule(&activeRule, current, next, size, worker);
+}
+
+void FreeField(bool** field, const unsigned short size) {
+    if (field == NULL) return;
+    fieldBlock* header = fieldHeader(field);
+    FreePages(header, header->mapped);
+    free(field - 1);
 }
\ No newline at end of file
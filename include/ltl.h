@@ -0,0 +1,76 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cells.h"
+#include "rules.h"
+#include "threads.h"
+
+// Larger-than-Life rules count the (2R+1)x(2R+1) square around each cell. Every band keeps
+// running column sums over the 2R+1 rows around the current row and slides a 2R+1 wide
+// window along them, so a cell costs the same for any range. The range reaches past the
+// one-cell halo, so these rules wrap by themselves: on a plane, or as a torus otherwise.
+
+static unsigned short* largerColumns[MAX_WORKERS];
+static int largerLength[MAX_WORKERS];
+
+static unsigned short* largerScratch(int worker, int length) {
+    if (largerLength[worker] < length) {
+        free(largerColumns[worker]);
+        largerColumns[worker] = (unsigned short*)malloc(length * sizeof(unsigned short));
+        if (largerColumns[worker] == NULL) {
+            fprintf(stderr, "Error: cannot allocate Larger-than-Life column sums\n");
+            exit(EXIT_FAILURE);
+        }
+        largerLength[worker] = length;
+    }
+    return largerColumns[worker];
+}
+
+static inline void addRow(unsigned short* columns, const bool* row, int size) {
+    for (int j = 0; j < size; j++) columns[j] += row[j];
+}
+
+static inline void subtractRow(unsigned short* columns, const bool* row, int size) {
+    for (int j = 0; j < size; j++) columns[j] -= row[j];
+}
+
+uint64_t StepLargerRows(const rule* rule, bool plane, bool** current, bool** next, int size, int begin, int end, int worker, long long* population) {
+    int range = rule->range;
+    int width = 2 * range + 1;
+    unsigned short* padded = largerScratch(worker, size + 2 * range); // Column j sits at range + j, wrapped copies around it
+    unsigned short* columns = padded + range;
+    unsigned low[2] = {rule->birthMin, rule->surviveMin};
+    unsigned span[2] = {rule->birthMax - rule->birthMin, rule->surviveMax - rule->surviveMin};
+    uint64_t hash = 0;
+
+    memset(columns, 0, size * sizeof(unsigned short));
+    for (int d = -range; d <= range; d++) {
+        if (!plane || (begin + d >= 0 && begin + d < size)) addRow(columns, current[((begin + d) % size + size) % size], size);
+    }
+
+    for (int i = begin; i < end; i++) {
+        if (i > begin) {
+            if (!plane || i + range < size) addRow(columns, current[(i + range) % size], size);
+            if (!plane || i - range - 1 >= 0) subtractRow(columns, current[((i - range - 1) % size + size) % size], size);
+        }
+        for (int k = 0; k < range; k++) { // Fields narrower than the window wrap more than once
+            padded[k] = plane ? 0 : columns[((k - range) % size + size) % size];
+            columns[size + k] = plane ? 0 : columns[k % size];
+        }
+
+        const bool* mid = current[i];
+        bool* row = next[i];
+        unsigned sum = 0;
+        for (int k = 0; k < width; k++) sum += padded[k];
+        for (int j = 0; j < size; j++) {
+            bool alive = mid[j];
+            unsigned count = sum - (rule->middle ? 0 : alive);
+            row[j] = count - low[alive] <= span[alive]; // Counts below the interval wrap around to large values
+            if (j + 1 < size) sum += padded[j + width] - padded[j]; // The last cell's window has nowhere to slide
+        }
+        hash += scanRow(row, size, i, population);
+    }
+    return hash;
+}
@@ -0,0 +1,440 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "rules.h"
+#include "cells.h"
+#include "rle.h"
+
+// Golly macrocell (.mc) import and export. A macrocell file is a quadtree: 8x8 leaves
+// written as '.', '*' and '$', then "level nw ne sw se" lines naming earlier nodes, the
+// last one being the root. Nodes are hash-consed as they are read, so repeated subtrees
+// share one node, and only the part of the tree over the field is ever flattened; a
+// pattern whose flat size is far beyond memory loads in the size of its node graph.
+// The root's centre is the field's centre, so export and import place cells alike.
+
+#define QUAD_LEAF 3       // Leaves are 8x8
+#define QUAD_MAX_LEVEL 62 // Corners of larger roots do not fit in a long long
+
+typedef struct quadNode {
+    uint64_t bits;       // Leaves: bit r * 8 + c is the cell in row r, column c
+    uint32_t child[4];   // Above the leaves: nw, ne, sw, se, 0 for an empty quadrant
+    int level;
+} quadNode;
+
+typedef struct quadTree {
+    quadNode* nodes;     // Node 0 stands for every empty subtree
+    size_t count, capacity;
+    uint64_t* slots;     // Open addressing: high half of the hash, low half the node id, 0 is free
+    size_t slotCount;
+} quadTree;
+
+typedef struct quadLayer { // Node ids of one level over the field, a square of count x count
+    uint32_t* ids;
+    long long first;       // Quadrant index of ids[0] on both axes, counted from the root's corner
+    long long count;
+} quadLayer;
+
+static char leafText[256][10];       // A leaf row in the file, '$' included
+static unsigned char leafLength[256];
+
+static void leafTables(void) {
+    buildCellSpread();
+    if (leafLength[1] != 0) return;
+    for (int byte = 0; byte < 256; byte++) {
+        int length = 0;
+        for (int c = 0; c < 8; c++) {
+            if (byte >> c) leafText[byte][length++] = (byte >> c) & 1 ? '*' : '.';
+        }
+        leafText[byte][length++] = '$';
+        leafLength[byte] = (unsigned char)length;
+    }
+}
+
+static uint64_t quadHash(const quadNode* node) {
+    uint64_t west = (uint64_t)node->child[0] << 32 | node->child[2];
+    uint64_t east = (uint64_t)node->child[1] << 32 | node->child[3];
+    return mixHash(node->bits ^ (uint64_t)node->level << 56 ^ west * 0x9e3779b97f4a7c15ull ^ east * 0xc2b2ae3d27d4eb4full);
+}
+
+static bool quadEqual(const quadNode* a, const quadNode* b) {
+    return a->level == b->level && a->bits == b->bits && memcmp(a->child, b->child, sizeof(a->child)) == 0;
+}
+
+static bool quadRehash(quadTree* tree, size_t slotCount) {
+    uint64_t* slots = (uint64_t*)calloc(slotCount, sizeof(uint64_t));
+    if (slots == NULL) return false;
+    for (size_t id = 1; id < tree->count; id++) {
+        uint64_t hash = quadHash(&tree->nodes[id]);
+        size_t k = hash & (slotCount - 1);
+        while (slots[k] != 0) k = (k + 1) & (slotCount - 1);
+        slots[k] = (hash & 0xffffffff00000000ull) | id;
+    }
+    free(tree->slots);
+    tree->slots = slots;
+    tree->slotCount = slotCount;
+    return true;
+}
+
+static bool quadReserve(quadTree* tree) { // Room for one more node, node 0 made on first use
+    if (tree->count + 1 >= UINT32_MAX) return false;
+    if (tree->count + 1 >= tree->capacity) {
+        size_t capacity = tree->capacity ? tree->capacity * 2 : 1024;
+        quadNode* nodes = (quadNode*)realloc(tree->nodes, capacity * sizeof(quadNode));
+        if (nodes == NULL) return false;
+        tree->nodes = nodes;
+        tree->capacity = capacity;
+    }
+    if (tree->count == 0) memset(&tree->nodes[tree->count++], 0, sizeof(quadNode));
+    return (tree->count + 1) * 2 < tree->slotCount || quadRehash(tree, tree->slotCount ? tree->slotCount * 2 : 1024);
+}
+
+static bool quadIntern(quadTree* tree, const quadNode* node, uint32_t* id) { // Id of the equal node, added if new; false when out of memory
+    if (node->bits == 0 && (node->child[0] | node->child[1] | node->child[2] | node->child[3]) == 0) {
+        *id = 0;
+        return true;
+    }
+    if (!quadReserve(tree)) return false;
+    uint64_t hash = quadHash(node);
+    uint64_t tag = hash & 0xffffffff00000000ull; // Most probes are settled without touching the node
+    size_t k = hash & (tree->slotCount - 1);
+    for (; tree->slots[k] != 0; k = (k + 1) & (tree->slotCount - 1)) {
+        uint32_t other = (uint32_t)tree->slots[k];
+        if ((tree->slots[k] & 0xffffffff00000000ull) == tag && quadEqual(&tree->nodes[other], node)) {
+            *id = other;
+            return true;
+        }
+    }
+    tree->nodes[tree->count] = *node;
+    tree->slots[k] = tag | tree->count;
+    *id = (uint32_t)tree->count++;
+    return true;
+}
+
+static void quadFree(quadTree* tree) {
+    free(tree->nodes);
+    free(tree->slots);
+    memset(tree, 0, sizeof(*tree));
+}
+
+static void quadFlatten(const quadTree* tree, uint32_t id, int level, long long top, long long left, bool** field, int size) {
+    long long extent = 1ll << level;
+    if (id == 0 || top >= size || left >= size || top + extent <= 0 || left + extent <= 0) return;
+    const quadNode* node = &tree->nodes[id];
+    if (level == QUAD_LEAF) {
+        bool inside = left >= 0 && left + 8 <= size;
+        for (int r = 0; r < 8; r++) {
+            unsigned byte = (node->bits >> (r * 8)) & 0xff;
+            if (top + r < 0 || top + r >= size || byte == 0) continue;
+            if (inside) {
+                memcpy(field[top + r] + left, &cellSpread[byte], 8); // Leaves do not overlap, the field starts clear
+                continue;
+            }
+            for (int c = 0; c < 8; c++) {
+                if (left + c >= 0 && left + c < size && (byte >> c) & 1) field[top + r][left + c] = 1;
+            }
+        }
+        return;
+    }
+    long long half = extent / 2;
+    quadFlatten(tree, node->child[0], level - 1, top, left, field, size);
+    quadFlatten(tree, node->child[1], level - 1, top, left + half, field, size);
+    quadFlatten(tree, node->child[2], level - 1, top + half, left, field, size);
+    quadFlatten(tree, node->child[3], level - 1, top + half, left + half, field, size);
+}
+
+static inline uint64_t byteFlags(uint64_t word, unsigned char c) { // 0x80 in every byte of word equal to c
+    uint64_t x = word ^ (0x0101010101010101ull * c);
+    return ~(((x & 0x7f7f7f7f7f7f7f7full) + 0x7f7f7f7f7f7f7f7full) | x | 0x7f7f7f7f7f7f7f7full);
+}
+
+static uint64_t leafBits(const char* line) { // "..*$...*$.***$", rows from the top; line has 8 readable bytes past its end
+    uint64_t bits = 0;
+    for (int r = 0;; r++) { // A row at a time: its cells end at the first byte that is neither '.' nor '*'
+        uint64_t word;
+        memcpy(&word, line, sizeof(word));
+        uint64_t stars = byteFlags(word, '*');
+        uint64_t other = ~(stars | byteFlags(word, '.')) & 0x8080808080808080ull;
+        int cells = other ? __builtin_ctzll(other) / 8 : 8;
+        uint64_t row = cells < 8 ? stars & ((1ull << (cells * 8)) - 1) : stars;
+        if (r < 8) bits |= ((row >> 7) * 0x0102040810204080ull) >> 56 << (r * 8); // Gathers each byte's flag
+        line += cells;
+        while (*line == '.' || *line == '*') line++; // Rows longer than a leaf
+        if (*line != '$') return bits;
+        line++;
+    }
+}
+
+static bool nodeLine(const char* line, int* level, unsigned long long child[4]) { // "5 12 0 13 14"
+    char* end;
+    long value = strtol(line, &end, 10);
+    if (end == line || value < 0 || value > 255) return false;
+    *level = (int)value;
+    for (int q = 0; q < 4; q++) {
+        line = end;
+        child[q] = strtoull(line, &end, 10);
+        if (end == line) return false;
+    }
+    return true;
+}
+
+bool ReadMacrocell(const char* filename, bool** field, unsigned short size) { // Replaces the field with the pattern around its centre
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) return false;
+
+    char line[1024 + 8] = ""; // Leaf rows are read a word at a time past the line's end
+    if (fgets(line, 1024, file) == NULL || strncmp(line, "[M2]", 4) != 0) {
+        fprintf(stderr, "Error: %s has no macrocell header\n", filename);
+        fclose(file);
+        return false;
+    }
+    leafTables();
+
+    quadTree tree = {0};
+    uint32_t* ids = (uint32_t*)malloc(1024 * sizeof(uint32_t)); // File node n (from 1) is tree node ids[n]
+    size_t idCount = 1, idCapacity = 1024;
+    if (ids == NULL) {
+        fclose(file);
+        return false;
+    }
+    ids[0] = 0;
+    char ruleText[RULE_NAME] = "";
+    uint32_t root = 0;
+    int rootLevel = QUAD_LEAF;
+    bool ok = true;
+    while (ok && fgets(line, 1024, file) != NULL) {
+        if (line[0] == '#') {
+            if (line[1] == 'R') sscanf(line + 2, " %95s", ruleText);
+            continue;
+        }
+        if (line[strspn(line, " \t\r\n")] == '\0') continue;
+
+        quadNode node;
+        memset(&node, 0, sizeof(node));
+        if (line[0] == '.' || line[0] == '*' || line[0] == '$') {
+            node.level = QUAD_LEAF;
+            node.bits = leafBits(line);
+        } else {
+            unsigned long long child[4];
+            if (!nodeLine(line, &node.level, child)) {
+                fprintf(stderr, "Error: %s: bad node line %.40s\n", filename, line);
+                ok = false;
+                break;
+            }
+            if (node.level <= QUAD_LEAF || node.level > QUAD_MAX_LEVEL) {
+                fprintf(stderr, "Error: %s: unsupported node level %d (multi-state files are not read)\n", filename, node.level);
+                ok = false;
+                break;
+            }
+            for (int q = 0; q < 4; q++) { // Children come earlier and sit one level down
+                if (child[q] >= idCount || (ids[child[q]] != 0 && tree.nodes[ids[child[q]]].level != node.level - 1)) {
+                    fprintf(stderr, "Error: %s: node %zu has a bad child\n", filename, idCount);
+                    ok = false;
+                    break;
+                }
+                node.child[q] = ids[child[q]];
+            }
+            if (!ok) break;
+        }
+
+        if (idCount == idCapacity) {
+            uint32_t* grown = (uint32_t*)realloc(ids, idCapacity * 2 * sizeof(uint32_t));
+            if (grown == NULL) {
+                ok = false;
+                break;
+            }
+            ids = grown;
+            idCapacity *= 2;
+        }
+        if (!quadIntern(&tree, &node, &ids[idCount])) {
+            fprintf(stderr, "Error: %s: out of memory after %zu nodes\n", filename, idCount - 1);
+            ok = false;
+            break;
+        }
+        root = ids[idCount++];
+        rootLevel = node.level;
+    }
+    fclose(file);
+
+    if (ok) {
+        if (ruleText[0] != '\0') {
+            if (ParseRule(ruleText, &activeRule)) printf("Rule: %s\n", activeRule.name);
+            else fprintf(stderr, "Error: unknown rule %s, keeping %s\n", ruleText, activeRule.name);
+        }
+        for (int i = 0; i < size; i++) {
+            memset(field[i], 0, size);
+        }
+        long long corner = size / 2 - (1ll << (rootLevel - 1));
+        quadFlatten(&tree, root, rootLevel, corner, corner, field, size);
+        printf("Pattern: %s, %zu nodes (%zu distinct), level %d\n", filename, idCount - 1, tree.count ? tree.count - 1 : 0, rootLevel);
+    }
+    free(ids);
+    quadFree(&tree);
+    return ok;
+}
+
+static inline uint32_t layerAt(const quadLayer* layer, long long a, long long b) { // 0 outside the field
+    a -= layer->first;
+    b -= layer->first;
+    return a >= 0 && a < layer->count && b >= 0 && b < layer->count ? layer->ids[a * layer->count + b] : 0;
+}
+
+static bool leafLayer(quadTree* tree, bool** field, int size, long long corner, quadLayer* layer) { // Leaves a band of eight rows at a time
+    layer->first = -corner / 8;
+    layer->count = (size - 1 - corner) / 8 - layer->first + 1;
+    layer->ids = (uint32_t*)malloc(layer->count * layer->count * sizeof(uint32_t));
+    uint64_t* band = (uint64_t*)malloc(layer->count * sizeof(uint64_t));
+    bool ok = layer->ids != NULL && band != NULL;
+
+    for (long long a = 0; ok && a < layer->count; a++) {
+        long long top = corner + (layer->first + a) * 8;
+        memset(band, 0, layer->count * sizeof(uint64_t));
+        for (int r = 0; r < 8; r++) {
+            if (top + r < 0 || top + r >= size) continue;
+            const bool* row = field[top + r];
+            for (long long b = 0; b < layer->count; b++) {
+                long long left = corner + (layer->first + b) * 8;
+                uint64_t byte = 0;
+                if (left >= 0 && left + 8 <= size) {
+                    byte = (loadCells(row + left) * 0x0102040810204080ull) >> 56; // Gathers each cell's low bit
+                } else {
+                    for (int c = 0; c < 8; c++) {
+                        if (left + c >= 0 && left + c < size && row[left + c]) byte |= 1ull << c;
+                    }
+                }
+                band[b] |= byte << (r * 8);
+            }
+        }
+        quadNode node;
+        memset(&node, 0, sizeof(node));
+        node.level = QUAD_LEAF;
+        for (long long b = 0; ok && b < layer->count; b++) {
+            node.bits = band[b];
+            ok = quadIntern(tree, &node, &layer->ids[a * layer->count + b]);
+        }
+    }
+    free(band);
+    return ok;
+}
+
+static bool parentLayer(quadTree* tree, int level, const quadLayer* below, quadLayer* layer) {
+    layer->first = below->first / 2;
+    layer->count = (below->first + below->count - 1) / 2 - layer->first + 1;
+    layer->ids = (uint32_t*)malloc(layer->count * layer->count * sizeof(uint32_t));
+    bool ok = layer->ids != NULL;
+
+    quadNode node;
+    memset(&node, 0, sizeof(node));
+    node.level = level;
+    for (long long a = 0; ok && a < layer->count; a++) {
+        for (long long b = 0; ok && b < layer->count; b++) {
+            long long i = (layer->first + a) * 2, j = (layer->first + b) * 2;
+            node.child[0] = layerAt(below, i, j);
+            node.child[1] = layerAt(below, i, j + 1);
+            node.child[2] = layerAt(below, i + 1, j);
+            node.child[3] = layerAt(below, i + 1, j + 1);
+            ok = quadIntern(tree, &node, &layer->ids[a * layer->count + b]);
+        }
+    }
+    return ok;
+}
+
+static bool quadBuild(quadTree* tree, bool** field, int size, int level, long long corner, uint32_t* root) { // Bottom up, one level over the field at a time
+    quadLayer layer = {0};
+    bool ok = leafLayer(tree, field, size, corner, &layer);
+    for (int l = QUAD_LEAF + 1; ok && l <= level; l++) {
+        quadLayer above = {0};
+        ok = parentLayer(tree, l, &layer, &above);
+        free(layer.ids);
+        layer = above;
+    }
+    *root = ok ? layer.ids[0] : 0;
+    free(layer.ids);
+    return ok;
+}
+
+static char* appendNumber(char* text, uint32_t value) {
+    char digits[10];
+    int n = 0;
+    do digits[n++] = (char)('0' + value % 10); while (value /= 10);
+    while (n > 0) *text++ = digits[--n];
+    return text;
+}
+
+static uint32_t quadWrite(const quadTree* tree, uint32_t id, uint32_t* written, uint32_t* lines, patternWriter* writer) { // File index of the node, children first
+    if (id == 0 || written[id] != 0) return written[id];
+    const quadNode* node = &tree->nodes[id];
+    char text[96];
+    char* end = text;
+    if (node->level == QUAD_LEAF) {
+        int rows = 8;
+        while (((node->bits >> ((rows - 1) * 8)) & 0xff) == 0) rows--; // Leaves are never empty
+        for (int r = 0; r < rows; r++) {
+            unsigned byte = (node->bits >> (r * 8)) & 0xff;
+            memcpy(end, leafText[byte], sizeof(leafText[byte]));
+            end += leafLength[byte];
+        }
+    } else {
+        uint32_t child[4];
+        for (int q = 0; q < 4; q++) child[q] = quadWrite(tree, node->child[q], written, lines, writer);
+        end = appendNumber(end, (uint32_t)node->level);
+        for (int q = 0; q < 4; q++) {
+            *end++ = ' ';
+            end = appendNumber(end, child[q]);
+        }
+    }
+    *end++ = '\n';
+    writerPut(writer, text, end - text);
+    written[id] = ++*lines;
+    return written[id];
+}
+
+bool WriteMacrocell(const char* filename, bool** field, unsigned short size) { // The whole field, its centre at the root's centre
+    int level = QUAD_LEAF;
+    while ((1ll << (level - 1)) < size - size / 2) level++;
+    long long corner = size / 2 - (1ll << (level - 1));
+    leafTables();
+
+    quadTree tree = {0};
+    uint32_t root = 0;
+    if (!quadBuild(&tree, field, size, level, corner, &root)) {
+        quadFree(&tree);
+        return false;
+    }
+    uint32_t* written = (uint32_t*)calloc(tree.count + 1, sizeof(uint32_t));
+    patternWriter writer;
+    if (written == NULL || !openWriter(&writer, filename)) {
+        free(written);
+        quadFree(&tree);
+        return false;
+    }
+
+    char header[RULE_NAME + 64];
+    int length = snprintf(header, sizeof(header), "[M2] (Game-of-Life)\n#R %s\n", activeRule.name);
+    writerPut(&writer, header, length);
+    uint32_t lines = 0;
+    if (root == 0) { // Golly wants a root, so an empty field is one blank node
+        length = snprintf(header, sizeof(header), "%d 0 0 0 0\n", level > QUAD_LEAF ? level : QUAD_LEAF + 1);
+        writerPut(&writer, header, length);
+    } else {
+        quadWrite(&tree, root, written, &lines, &writer);
+    }
+    free(written);
+    quadFree(&tree);
+    return closeWriter(&writer);
+}
+
+bool ReadPattern(const char* filename, bool** field, unsigned short size) { // .mc is a macrocell, anything else RLE
+    const char* dot = strrchr(filename, '.');
+    if (dot != NULL && strcmp(dot, ".mc") == 0) return ReadMacrocell(filename, field, size);
+    return ReadRle(filename, field, size);
+}
+
+bool ExportPattern(const char* filename, bool** field, unsigned short size) { // .cells is plaintext, .mc a macrocell, anything else RLE
+    const char* dot = strrchr(filename, '.');
+    if (dot != NULL && strcmp(dot, ".cells") == 0) return WriteCells(filename, field, size);
+    if (dot != NULL && strcmp(dot, ".mc") == 0) return WriteMacrocell(filename, field, size);
+    return WriteRle(filename, field, size);
+}
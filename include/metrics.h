@@ -0,0 +1,201 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET metricsSocket;
+#define closeSocket closesocket
+#define SHUT_RDWR SD_BOTH
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+typedef int metricsSocket;
+#define INVALID_SOCKET (-1)
+#define closeSocket close
+#endif
+#include "stats.h"
+
+#define METRICS_BODY 16384
+#define METRICS_FIRST_BUCKET 10 // 2^10 ns, about 1 us
+#define METRICS_LAST_BUCKET 34  // 2^34 ns, about 17 s
+#define METRICS_TIMEOUT_MS 1000 // Clients are served one at a time, so a stalled one is dropped after this
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0          // Windows has no SIGPIPE, macOS gets SO_NOSIGPIPE instead
+#endif
+
+static metricsSocket metricsListener = INVALID_SOCKET;
+static metricsSocket metricsClient = INVALID_SOCKET; // Connection being served, so StopMetrics can cut it off
+static bool metricsStopping = false;
+static pthread_mutex_t metricsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t metricsThread;
+static char metricsPath[108] = "";
+
+static int appendMetric(char* body, int length, const char* name, const char* type, const char* help, double value) {
+    return length + snprintf(body + length, METRICS_BODY - length,
+                             "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
+
+int FormatMetrics(char* body) { // Prometheus text exposition format 0.0.4
+    int length = 0;
+    length = appendMetric(body, length, "gol_generation", "counter", "Generations stepped.", (double)STAT_GET(generation));
+    length = appendMetric(body, length, "gol_generations_per_second", "gauge", "Mean stepping rate since start.", GenerationsPerSecond());
+    length = appendMetric(body, length, "gol_population", "gauge", "Live cells.", (double)STAT_GET(population));
+    length = appendMetric(body, length, "gol_memory_bytes", "gauge", "Bytes mapped for fields.", (double)pagesInUse);
+    length = appendMetric(body, length, "gol_history_bytes", "gauge", "Bytes kept for rewind and undo.", (double)STAT_GET(historyBytes));
+    length = appendMetric(body, length, "gol_cycle_period", "gauge", "Period of the detected cycle, 0 if none.", (double)STAT_GET(cyclePeriod));
+
+    uint64_t checkpoint = STAT_GET(checkpointNs);
+    if (checkpoint != 0) {
+        length = appendMetric(body, length, "gol_checkpoint_age_seconds", "gauge", "Seconds since the field was last saved.",
+                              (MonotonicNs() - checkpoint) / 1e9);
+    }
+
+    length += snprintf(body + length, METRICS_BODY - length,
+                       "# HELP gol_step_duration_seconds Time spent in NextStep.\n# TYPE gol_step_duration_seconds histogram\n");
+    unsigned long long cumulative = 0;
+    int bucket = 0;
+    for (int exponent = METRICS_FIRST_BUCKET; exponent <= METRICS_LAST_BUCKET; exponent++) {
+        for (; bucket < LATENCY_BUCKETS && BucketLimit(bucket) < (1ull << exponent); bucket++) {
+            cumulative += STAT_GET(latency[bucket]);
+        }
+        length += snprintf(body + length, METRICS_BODY - length,
+                           "gol_step_duration_seconds_bucket{le=\"%.9g\"} %llu\n", (1ull << exponent) / 1e9, cumulative);
+    }
+    for (; bucket < LATENCY_BUCKETS; bucket++) {
+        cumulative += STAT_GET(latency[bucket]);
+    }
+    length += snprintf(body + length, METRICS_BODY - length,
+                       "gol_step_duration_seconds_bucket{le=\"+Inf\"} %llu\n"
+                       "gol_step_duration_seconds_sum %.9f\n"
+                       "gol_step_duration_seconds_count %llu\n",
+                       cumulative, STAT_GET(totalNs) / 1e9, cumulative);
+    return length;
+}
+
+static void prepareClient(metricsSocket client) { // Bounded waits, and a client hanging up mid-reply must not kill the process
+#ifdef _WIN32
+    DWORD timeout = METRICS_TIMEOUT_MS;
+#else
+    struct timeval timeout = {METRICS_TIMEOUT_MS / 1000, METRICS_TIMEOUT_MS % 1000 * 1000};
+#endif
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+static bool sendAll(metricsSocket client, const char* data, int length) {
+    while (length > 0) {
+        int sent = (int)send(client, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) return false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+static void* metricsMain(void* arg) {
+    char request[1024];
+    char* body = (char*)malloc(METRICS_BODY);
+    char header[128];
+
+    for (;;) {
+        metricsSocket client = accept(metricsListener, NULL, NULL);
+        if (client == INVALID_SOCKET) break; // Listener closed by StopMetrics
+
+        pthread_mutex_lock(&metricsLock);
+        bool stopping = metricsStopping;
+        if (!stopping) metricsClient = client;
+        pthread_mutex_unlock(&metricsLock);
+        if (stopping) {
+            closeSocket(client);
+            break;
+        }
+
+        prepareClient(client);
+        if (recv(client, request, sizeof(request), 0) > 0) { // Any request gets the metrics page
+            int length = FormatMetrics(body);
+            int headerLength = snprintf(header, sizeof(header),
+                                        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", length);
+            if (sendAll(client, header, headerLength)) sendAll(client, body, length);
+        }
+
+        pthread_mutex_lock(&metricsLock);
+        metricsClient = INVALID_SOCKET;
+        pthread_mutex_unlock(&metricsLock);
+        closeSocket(client);
+    }
+    free(body);
+    return NULL;
+}
+
+bool StartMetrics(const char* address) { // "9100" listens on 127.0.0.1:9100, "unix:/path" on a socket file
+#ifdef _WIN32
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0) return false;
+#endif
+    metricsStopping = false;
+    if (strncmp(address, "unix:", 5) == 0) {
+#ifdef _WIN32
+        return false;
+#else
+        struct sockaddr_un local = {0};
+        local.sun_family = AF_UNIX;
+        snprintf(metricsPath, sizeof(metricsPath), "%s", address + 5);
+        snprintf(local.sun_path, sizeof(local.sun_path), "%s", metricsPath);
+        unlink(metricsPath);
+        metricsListener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (metricsListener == INVALID_SOCKET) return false;
+        if (bind(metricsListener, (struct sockaddr*)&local, sizeof(local)) != 0) {
+            closeSocket(metricsListener);
+            return false;
+        }
+#endif
+    } else {
+        struct sockaddr_in local = {0};
+        local.sin_family = AF_INET;
+        local.sin_port = htons((unsigned short)atoi(address));
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        metricsListener = socket(AF_INET, SOCK_STREAM, 0);
+        if (metricsListener == INVALID_SOCKET) return false;
+        int reuse = 1;
+        setsockopt(metricsListener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+        if (bind(metricsListener, (struct sockaddr*)&local, sizeof(local)) != 0) {
+            closeSocket(metricsListener);
+            return false;
+        }
+    }
+
+    if (listen(metricsListener, 8) != 0 || pthread_create(&metricsThread, NULL, metricsMain, NULL) != 0) {
+        closeSocket(metricsListener);
+        metricsListener = INVALID_SOCKET;
+        return false;
+    }
+    return true;
+}
+
+void StopMetrics(void) {
+    if (metricsListener == INVALID_SOCKET) return;
+    pthread_mutex_lock(&metricsLock);
+    metricsStopping = true;
+    if (metricsClient != INVALID_SOCKET) shutdown(metricsClient, SHUT_RDWR); // Wakes a blocked recv or send
+    pthread_mutex_unlock(&metricsLock);
+#ifdef _WIN32
+    closeSocket(metricsListener);
+#else
+    shutdown(metricsListener, SHUT_RDWR); // Wakes the blocked accept
+    closeSocket(metricsListener);
+    if (metricsPath[0] != '\0') unlink(metricsPath);
+#endif
+    pthread_join(metricsThread, NULL);
+    metricsListener = INVALID_SOCKET;
+}
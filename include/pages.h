@@ -0,0 +1,168 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#define HUGE_PAGE_SIZE (2u << 20)
+#define MAX_NODES 64
+
+typedef enum {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_MADVISE,  // Transparent huge pages, falls back silently
+    HUGE_PAGES_HUGETLB,  // Reserved huge pages, falls back to madvise
+} hugePagePolicy;
+
+typedef enum {
+    PLACEMENT_LOCAL,        // Allocating thread touches every page
+    PLACEMENT_FIRST_TOUCH,  // Each worker touches its own band of rows
+} placementPolicy;
+
+hugePagePolicy hugePages = HUGE_PAGES_MADVISE;
+placementPolicy placement = PLACEMENT_FIRST_TOUCH;
+_Atomic size_t pagesInUse = 0; // Bytes currently mapped for fields, read by the metrics thread
+
+hugePagePolicy ParseHugePages(const char* value) {
+    if (strcmp(value, "off") == 0) return HUGE_PAGES_OFF;
+    if (strcmp(value, "hugetlb") == 0) return HUGE_PAGES_HUGETLB;
+    return HUGE_PAGES_MADVISE;
+}
+
+placementPolicy ParsePlacement(const char* value) {
+    if (strcmp(value, "local") == 0) return PLACEMENT_LOCAL;
+    return PLACEMENT_FIRST_TOUCH;
+}
+
+void* AllocPages(size_t bytes, size_t* mapped) {
+    void* block = NULL;
+    bool huge = hugePages != HUGE_PAGES_OFF && bytes >= HUGE_PAGE_SIZE; // Small fields would waste most of a page
+#ifdef _WIN32
+    if (huge) { // Needs SeLockMemoryPrivilege, plain pages otherwise
+        size_t large = GetLargePageMinimum();
+        if (large > 0) {
+            size_t rounded = (bytes + large - 1) / large * large;
+            block = VirtualAlloc(NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (block != NULL) bytes = rounded;
+        }
+    }
+    if (block == NULL) {
+        block = VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+#else
+    if (huge) {
+        bytes = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+#ifdef MAP_HUGETLB
+    if (huge && hugePages == HUGE_PAGES_HUGETLB) {
+        block = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (block == MAP_FAILED) block = NULL;
+    }
+#endif
+    if (block == NULL) {
+        block = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) block = NULL;
+#ifdef MADV_HUGEPAGE
+        if (block != NULL && huge) {
+            madvise(block, bytes, MADV_HUGEPAGE);
+        }
+#endif
+    }
+#endif
+    if (block != NULL) {
+        *mapped = bytes;
+        pagesInUse += bytes;
+    }
+    return block;
+}
+
+void FreePages(void* block, size_t mapped) {
+    if (block == NULL) return;
+#ifdef _WIN32
+    VirtualFree(block, 0, MEM_RELEASE);
+#else
+    munmap(block, mapped);
+#endif
+    pagesInUse -= mapped;
+}
+
+int NumaNodeCount(void) {
+    static int nodes = 0;
+    if (nodes == 0) {
+        nodes = 1;
+#ifdef __linux__
+        char path[64];
+        for (int node = 1; node < MAX_NODES; node++) {
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+            if (access(path, F_OK) != 0) break;
+            nodes = node + 1;
+        }
+#endif
+    }
+    return nodes;
+}
+
+bool PinToNode(int node) { // Restricts the calling thread to the CPUs of one node
+#ifdef __linux__
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return false;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    int first, last;
+    while (fscanf(file, "%d", &first) == 1) {
+        last = first;
+        if (fscanf(file, "-%d", &last) != 1) last = first;
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, &cpus);
+        }
+        if (fgetc(file) != ',') break;
+    }
+    fclose(file);
+    return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+#else
+    (void)node;
+    return false;
+#endif
+}
+
+int PagesPerNode(void* block, size_t bytes, size_t* perNode) { // Returns node count, 0 if unknown
+#if defined(__linux__) && defined(SYS_move_pages)
+    enum { BATCH = 4096 };
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    void* pages[BATCH];
+    int status[BATCH];
+    int nodes = NumaNodeCount();
+
+    for (int node = 0; node < nodes; node++) perNode[node] = 0;
+    for (size_t offset = 0; offset < bytes; ) {
+        int count = 0;
+        for (; count < BATCH && offset < bytes; count++, offset += pageSize) {
+            pages[count] = (char*)block + offset;
+        }
+        if (syscall(SYS_move_pages, 0, (unsigned long)count, pages, NULL, status, 0) != 0) return 0;
+        for (int i = 0; i < count; i++) {
+            if (status[i] >= 0 && status[i] < nodes) perNode[status[i]] += pageSize; // Untouched pages report -ENOENT
+        }
+    }
+    return nodes;
+#else
+    (void)block;
+    (void)bytes;
+    (void)perNode;
+    return 0;
+#endif
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "threads.h"
+#include "cells.h"
+
+// Seeded random fills. Every row of the region has its own xoshiro256** stream seeded
+// from the fill seed and the row, so the result only depends on the seed and the region's
+// size, not on how rows are split between workers. Cells are drawn 64 at a time: the
+// density is a 16-bit threshold, and comparing 64 random numbers against it is done
+// bit-sliced, one random word per threshold bit from the lowest set one up. A density of
+// one half costs one word per 64 cells, and none costs more than 16.
+
+#define FILL_BITS 16   // Density resolution, 1 / 65536
+
+typedef struct xoshiro {
+    uint64_t s[4];
+} xoshiro;
+
+typedef struct fillJob {
+    bool** field;
+    int top, left, width;
+    int first;                      // Region row of band row 0
+    unsigned threshold;             // Density * 2^FILL_BITS, 2^FILL_BITS fills every cell
+    uint64_t seed;
+    long long change[MAX_WORKERS];  // Population change of each worker's rows
+} fillJob;
+
+static uint64_t splitMix(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rotateLeft(uint64_t x, int k) {
+    return x << k | x >> (64 - k);
+}
+
+static void seedXoshiro(xoshiro* rng, uint64_t seed) { // splitMix never gives four zero words
+    for (int k = 0; k < 4; k++) rng->s[k] = splitMix(&seed);
+}
+
+static inline uint64_t nextXoshiro(xoshiro* rng) {
+    uint64_t* s = rng->s;
+    uint64_t result = rotateLeft(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotateLeft(s[3], 45);
+    return result;
+}
+
+static inline uint64_t randomCells(xoshiro* rng, unsigned threshold) { // Each bit set with probability threshold / 2^FILL_BITS
+    if (threshold == 0) return 0;
+    if (threshold >= 1u << FILL_BITS) return ~0ull;
+    int low = __builtin_ctz(threshold);
+    uint64_t cells = nextXoshiro(rng);
+    for (int i = low + 1; i < FILL_BITS; i++) { // From the lowest weight up: set bits OR a new word in, clear bits AND it
+        uint64_t word = nextXoshiro(rng);
+        cells = (threshold >> i) & 1 ? cells | word : cells & word;
+    }
+    return cells;
+}
+
+static void fillRows(void* arg, int begin, int end, int worker) {
+    fillJob* job = (fillJob*)arg;
+    int width = job->width;
+    long long change = 0;
+    for (int r = job->first + begin; r < job->first + end; r++) {
+        bool* row = job->field[job->top + r] + job->left;
+        xoshiro rng;
+        seedXoshiro(&rng, mixHash(job->seed ^ mixHash((uint64_t)r + 1)));
+        change -= CountRow(row, width);
+        int j = 0;
+        for (; j + 64 <= width; j += 64) {
+            uint64_t cells = randomCells(&rng, job->threshold);
+            for (int b = 0; b < 64; b += 8) memcpy(row + j + b, &cellSpread[(cells >> b) & 0xff], 8);
+            change += __builtin_popcountll(cells);
+        }
+        if (j < width) {
+            uint64_t cells = randomCells(&rng, job->threshold) & ((1ull << (width - j)) - 1);
+            for (int k = 0; j + k < width; k++) row[j + k] = (cells >> k) & 1;
+            change += __builtin_popcountll(cells);
+        }
+    }
+    job->change[worker] = change;
+}
+
+static unsigned fillThreshold(double density) {
+    return density <= 0 ? 0 : density >= 1 ? 1u << FILL_BITS : (unsigned)(density * (1u << FILL_BITS) + 0.5);
+}
+
+long long FillRandom(bool** field, int top, int left, int height, int width, double density, uint64_t seed) { // Population change; the region must lie inside the field
+    if (height <= 0 || width <= 0) return 0;
+    buildCellSpread();
+    fillJob job = {field, top, left, width, 0, fillThreshold(density), seed, {0}};
+    RunBands(fillRows, &job, height);
+    long long change = 0;
+    for (int i = 0; i < pool.count; i++) change += job.change[i];
+    return change;
+}
+
+long long FillRandomRows(bool** field, int size, int first, int count, double density, uint64_t seed) { // Rows first..first+count-1 of a whole-field fill, the same cells FillRandom gives them
+    if (count <= 0 || size <= 0) return 0;
+    buildCellSpread();
+    fillJob job = {field, 0, 0, size, first, fillThreshold(density), seed, {0}};
+    RunBands(fillRows, &job, count);
+    long long change = 0;
+    for (int i = 0; i < pool.count; i++) change += job.change[i];
+    return change;
+}
+
+long long FillRandomAlone(bool** field, int top, int left, int height, int width, double density, uint64_t seed, int worker) { // FillRandom on the calling worker, same cells
+    if (height <= 0 || width <= 0) return 0;
+    buildCellSpread();
+    fillJob job = {field, top, left, width, 0, fillThreshold(density), seed, {0}};
+    fillRows(&job, 0, height, worker);
+    return job.change[worker];
+}
@@ -0,0 +1,363 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "threads.h"
+#include "cells.h"
+#include "frames.h"
+#include "trace.h"
+
+// Tile deltas and the rewind log. A delta cuts the field into tiles of 8 rows by 64
+// columns, and every tile that changed gets one word (low half: tile index, bits 32-39:
+// which of its rows changed) followed by the XOR of those rows, packed one bit per cell.
+// XORing a delta back in undoes the change, so it costs only the cells that changed.
+//
+// The rewind log keeps one delta per step. Once the deltas since the last keyframe outweigh a few packed
+// fields, the field is packed again as a keyframe; long jumps start from the nearest one
+// when that is cheaper than undoing every step in between. The oldest deltas are dropped
+// to stay inside the memory budget.
+
+#define REWIND_KEY_RATIO 4 // Delta words between keyframes, in packed fields
+
+typedef struct tileDiff {
+    uint64_t* band[MAX_WORKERS];    // Each worker's records for the delta being built
+    size_t bandWords[MAX_WORKERS], bandCapacity[MAX_WORKERS];
+    bool failed;                    // A worker ran out of memory
+} tileDiff;
+
+typedef struct tileJob {
+    tileDiff* diff;
+    bool** before;
+    const uint64_t* packed;         // Packed rows to diff against instead of before
+    bool** after;
+    int size;
+    size_t rowWords;
+} tileJob;
+
+static bool bandReserve(tileDiff* diff, int worker, size_t words) {
+    if (diff->bandWords[worker] + words <= diff->bandCapacity[worker]) return true;
+    size_t capacity = diff->bandCapacity[worker] ? diff->bandCapacity[worker] * 2 : 4096;
+    while (capacity < diff->bandWords[worker] + words) capacity *= 2;
+    uint64_t* grown = (uint64_t*)realloc(diff->band[worker], capacity * sizeof(uint64_t));
+    if (grown == NULL) return false;
+    diff->band[worker] = grown;
+    diff->bandCapacity[worker] = capacity;
+    return true;
+}
+
+static inline uint64_t gatherCells(const bool* cells) { // 64 cells to one bit each
+    uint64_t bits = 0;
+    for (int k = 0; k < 8; k++) {
+        bits |= ((loadCells(cells + k * 8) * 0x0102040810204080ull) >> 56) << (k * 8); // Gathers each byte's low bit
+    }
+    return bits;
+}
+
+static void diffTiles(void* arg, int begin, int end, int worker) { // Bands are counted in tile rows
+    tileJob* job = (tileJob*)arg;
+    tileDiff* diff = job->diff;
+    int size = job->size;
+    diff->bandWords[worker] = 0;
+    for (int t = begin; t < end; t++) {
+        int rows = size - t * 8 < 8 ? size - t * 8 : 8;
+        for (size_t w = 0; w < job->rowWords; w++) {
+            int j = (int)w * 64;
+            uint64_t tail = size - j >= 64 ? ~0ull : (1ull << (size - j)) - 1; // Drops the halo and padding
+            uint64_t words[8];
+            unsigned mask = 0;
+            for (int r = 0; r < rows; r++) {
+                const bool* after = job->after[t * 8 + r] + j;
+                uint64_t bits;
+                if (job->packed != NULL) {
+                    bits = job->packed[(size_t)(t * 8 + r) * job->rowWords + w] ^ (gatherCells(after) & tail);
+                } else {
+                    const bool* before = job->before[t * 8 + r] + j;
+                    uint64_t x[8], changed = 0;
+                    for (int k = 0; k < 8; k++) {
+                        x[k] = loadCells(before + k * 8) ^ loadCells(after + k * 8);
+                        changed |= x[k];
+                    }
+                    if (changed == 0) continue;
+                    bits = 0;
+                    for (int k = 0; k < 8; k++) bits |= ((x[k] * 0x0102040810204080ull) >> 56) << (k * 8);
+                    bits &= tail;
+                }
+                if (bits == 0) continue;
+                words[__builtin_popcount(mask)] = bits;
+                mask |= 1u << r;
+            }
+            if (mask == 0) continue;
+            int n = __builtin_popcount(mask);
+            if (!bandReserve(diff, worker, n + 1)) {
+                diff->failed = true;
+                return;
+            }
+            uint64_t* out = diff->band[worker] + diff->bandWords[worker];
+            out[0] = (uint64_t)(t * job->rowWords + w) | (uint64_t)mask << 32;
+            memcpy(out + 1, words, n * sizeof(uint64_t));
+            diff->bandWords[worker] += n + 1;
+        }
+    }
+}
+
+bool DiffTiles(tileDiff* diff, bool** before, const uint64_t* packed, bool** after, int size, uint64_t** data, size_t* words) { // Against before, or packed rows when given; false when out of memory
+    tileJob job = {diff, before, packed, after, size, ((size_t)size + 63) / 64};
+    diff->failed = false;
+    memset(diff->bandWords, 0, sizeof(diff->bandWords)); // Workers without a band leave theirs alone
+    RunBands(diffTiles, &job, (size + 7) / 8);
+
+    *data = NULL;
+    *words = 0;
+    for (int i = 0; i < pool.count; i++) *words += diff->bandWords[i];
+    if (diff->failed) return false;
+    if (*words == 0) return true;
+    *data = (uint64_t*)malloc(*words * sizeof(uint64_t));
+    if (*data == NULL) return false;
+    size_t offset = 0;
+    for (int i = 0; i < pool.count; i++) {
+        if (diff->bandWords[i] == 0) continue;
+        memcpy(*data + offset, diff->band[i], diff->bandWords[i] * sizeof(uint64_t));
+        offset += diff->bandWords[i];
+    }
+    return true;
+}
+
+void ApplyTiles(const uint64_t* data, size_t words, int size, bool** field) { // XORs a delta in, undoing or redoing it
+    size_t rowWords = ((size_t)size + 63) / 64;
+    for (size_t i = 0; i < words;) {
+        uint64_t header = data[i++];
+        size_t tile = (size_t)(uint32_t)header;
+        unsigned mask = (unsigned)(header >> 32) & 0xff;
+        int top = (int)(tile / rowWords) * 8;
+        int j = (int)(tile % rowWords) * 64;
+        for (int r = 0; r < 8; r++) {
+            if ((mask >> r & 1) == 0) continue;
+            uint64_t bits = data[i++];
+            bool* row = field[top + r] + j;
+            for (int k = 0; k < 8; k++, bits >>= 8) {
+                if ((bits & 0xff) == 0) continue;
+                uint64_t cells = loadCells(row + k * 8) ^ cellSpread[bits & 0xff];
+                memcpy(row + k * 8, &cells, sizeof(cells));
+            }
+        }
+    }
+}
+
+void FreeTileDiff(tileDiff* diff) {
+    for (int i = 0; i < MAX_WORKERS; i++) free(diff->band[i]);
+    memset(diff, 0, sizeof(*diff));
+}
+
+typedef struct rewindEntry {
+    uint64_t* data;                 // NULL when the step changed nothing
+    size_t words;
+    unsigned long long generation;  // Generation the delta goes back to
+    long long population;           // And its population
+} rewindEntry;
+
+typedef struct rewindKey {
+    uint64_t* packed;               // Rows of rowWords words, as PackField writes them
+    unsigned long long generation;
+} rewindKey;
+
+typedef struct rewindLog {
+    size_t budget;                  // Bytes, 0 disables the log
+    size_t used;
+    int size;
+    size_t rowWords;
+    rewindEntry* entries;           // Ring of consecutive generations, oldest at head
+    size_t head, count, capacity;
+    rewindKey* keys;                // Oldest first
+    int keyCount, keyCapacity;
+    size_t sinceKey;                // Delta words recorded since the last keyframe
+    tileDiff diff;
+} rewindLog;
+
+void CreateRewindLog(rewindLog* log, unsigned short size, size_t budget) {
+    memset(log, 0, sizeof(*log));
+    log->budget = budget;
+    log->size = size;
+    log->rowWords = ((size_t)size + 63) / 64;
+    buildCellSpread();
+}
+
+static inline size_t keyBytes(const rewindLog* log) {
+    return log->rowWords * log->size * sizeof(uint64_t);
+}
+
+static inline rewindEntry* entryAt(rewindLog* log, size_t index) { // 0 is the oldest
+    return &log->entries[(log->head + index) % log->capacity];
+}
+
+static void dropOldest(rewindLog* log) {
+    rewindEntry* entry = entryAt(log, 0);
+    log->used -= entry->words * sizeof(uint64_t) + sizeof(rewindEntry);
+    free(entry->data);
+    log->head = (log->head + 1) % log->capacity;
+    log->count--;
+}
+
+static void dropNewest(rewindLog* log) {
+    rewindEntry* entry = entryAt(log, log->count - 1);
+    log->used -= entry->words * sizeof(uint64_t) + sizeof(rewindEntry);
+    free(entry->data);
+    log->count--;
+}
+
+static void dropKeys(rewindLog* log, unsigned long long oldest, unsigned long long newest) { // Keeps keyframes in [oldest, newest]
+    int kept = 0;
+    for (int i = 0; i < log->keyCount; i++) {
+        if (log->keys[i].generation < oldest || log->keys[i].generation > newest) {
+            free(log->keys[i].packed);
+            log->used -= keyBytes(log);
+        } else {
+            log->keys[kept++] = log->keys[i];
+        }
+    }
+    log->keyCount = kept;
+}
+
+void ClearRewindLog(rewindLog* log) { // The field was edited, history no longer leads to it
+    while (log->count > 0) dropOldest(log);
+    dropKeys(log, 1, 0); // An empty range drops them all
+    log->sinceKey = 0;
+}
+
+void FreeRewindLog(rewindLog* log) {
+    ClearRewindLog(log);
+    free(log->entries);
+    free(log->keys);
+    FreeTileDiff(&log->diff);
+    memset(log, 0, sizeof(*log));
+}
+
+typedef struct unpackJob {
+    const uint64_t* packed;
+    bool** field;
+    int size;
+    size_t rowWords;
+} unpackJob;
+
+static void unpackRows(void* arg, int begin, int end, int worker) {
+    unpackJob* job = (unpackJob*)arg;
+    for (int i = begin; i < end; i++) {
+        const uint64_t* bits = job->packed + job->rowWords * i;
+        bool* row = job->field[i];
+        int j = 0;
+        for (; j + 8 <= job->size; j += 8) {
+            uint64_t cells = cellSpread[(bits[j >> 6] >> (j & 63)) & 0xff];
+            memcpy(row + j, &cells, sizeof(cells));
+        }
+        for (; j < job->size; j++) row[j] = (bits[j >> 6] >> (j & 63)) & 1;
+    }
+}
+
+static void trimRewindLog(rewindLog* log) {
+    while (log->used > log->budget && log->count > 0) {
+        dropOldest(log);
+        if (log->count > 0) dropKeys(log, entryAt(log, 0)->generation, ~0ull);
+    }
+    if (log->count == 0) dropKeys(log, 1, 0);
+}
+
+static bool pushEntry(rewindLog* log, rewindEntry entry) {
+    if (log->count == log->capacity) {
+        size_t capacity = log->capacity ? log->capacity * 2 : 1024;
+        rewindEntry* grown = (rewindEntry*)malloc(capacity * sizeof(rewindEntry));
+        if (grown == NULL) return false;
+        for (size_t i = 0; i < log->count; i++) grown[i] = *entryAt(log, i);
+        free(log->entries);
+        log->entries = grown;
+        log->capacity = capacity;
+        log->head = 0;
+    }
+    *entryAt(log, log->count) = entry;
+    log->count++;
+    log->used += entry.words * sizeof(uint64_t) + sizeof(rewindEntry);
+    return true;
+}
+
+static void pushKey(rewindLog* log, bool** field, unsigned long long generation) {
+    if (log->keyCount == log->keyCapacity) {
+        int capacity = log->keyCapacity ? log->keyCapacity * 2 : 16;
+        rewindKey* grown = (rewindKey*)realloc(log->keys, capacity * sizeof(rewindKey));
+        if (grown == NULL) return;
+        log->keys = grown;
+        log->keyCapacity = capacity;
+    }
+    uint64_t* packed = (uint64_t*)malloc(keyBytes(log));
+    if (packed == NULL) return; // Jumps fall back to undoing each step
+    PackField(field, log->size, packed);
+    log->keys[log->keyCount].packed = packed;
+    log->keys[log->keyCount].generation = generation;
+    log->keyCount++;
+    log->used += keyBytes(log);
+}
+
+void RecordRewind(rewindLog* log, bool** before, bool** after, unsigned long long generation, long long population) { // One step, from generation to generation + 1
+    if (log->budget == 0) return;
+    TRACE_SCOPE("RecordRewind");
+    if (log->count > 0 && entryAt(log, log->count - 1)->generation + 1 != generation) ClearRewindLog(log);
+
+    rewindEntry entry = {NULL, 0, generation, population};
+    if (!DiffTiles(&log->diff, before, NULL, after, log->size, &entry.data, &entry.words) || !pushEntry(log, entry)) { // History can't skip a step, so it starts over
+        free(entry.data);
+        ClearRewindLog(log);
+        return;
+    }
+
+    log->sinceKey += entry.words;
+    if (log->sinceKey >= REWIND_KEY_RATIO * keyBytes(log) / sizeof(uint64_t)) {
+        pushKey(log, after, generation + 1);
+        log->sinceKey = 0;
+    }
+    trimRewindLog(log);
+}
+
+unsigned long long RewindOldest(rewindLog* log, unsigned long long current) { // Earliest generation still reachable
+    return log->count > 0 ? entryAt(log, 0)->generation : current;
+}
+
+bool RewindTo(rewindLog* log, bool** field, unsigned long long current, unsigned long long target, long long* population) { // False when target is out of reach
+    if (log->count == 0 || target >= current || target < entryAt(log, 0)->generation) return false;
+    TRACE_SCOPE("RewindTo");
+    size_t index = target - entryAt(log, 0)->generation;
+    size_t back = 0;
+    for (size_t i = index; i < log->count; i++) back += entryAt(log, i)->words;
+
+    int key = -1;
+    size_t forward = 0;
+    for (int k = log->keyCount - 1; k >= 0; k--) {
+        if (log->keys[k].generation > target) continue;
+        key = k;
+        forward = keyBytes(log) / sizeof(uint64_t);
+        for (size_t i = log->keys[k].generation - entryAt(log, 0)->generation; i < index; i++) forward += entryAt(log, i)->words;
+        break;
+    }
+
+    if (key >= 0 && forward < back) { // Load the keyframe and replay forward
+        unpackJob job = {log->keys[key].packed, field, log->size, log->rowWords};
+        RunBands(unpackRows, &job, log->size);
+        for (size_t i = log->keys[key].generation - entryAt(log, 0)->generation; i < index; i++) {
+            ApplyTiles(entryAt(log, i)->data, entryAt(log, i)->words, log->size, field);
+        }
+    } else {
+        for (size_t i = log->count; i-- > index;) {
+            ApplyTiles(entryAt(log, i)->data, entryAt(log, i)->words, log->size, field);
+        }
+    }
+
+    *population = entryAt(log, index)->population;
+    while (log->count > index) dropNewest(log);
+    dropKeys(log, 0, target);
+    if (log->count == 0) dropKeys(log, 1, 0);
+
+    unsigned long long since = log->keyCount > 0 ? log->keys[log->keyCount - 1].generation : 0;
+    log->sinceKey = 0;
+    for (size_t i = 0; i < log->count; i++) {
+        if (entryAt(log, i)->generation >= since) log->sinceKey += entryAt(log, i)->words;
+    }
+    return true;
+}
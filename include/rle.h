@@ -0,0 +1,372 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include "threads.h"
+#include "rules.h"
+#include "cells.h"
+
+// Golly RLE import. The pattern body is read in chunks cut after a row end ('$'), so only
+// one chunk is ever in memory. Each chunk is split into segments at row ends; the workers
+// count the rows every segment advances, a prefix sum gives each segment its first row,
+// and the workers then decode their segments straight into the field, a run per memset.
+// Export finds runs 64 cells at a time in a bit mask and formats them into a large buffer.
+
+#define RLE_CHUNK (4 << 20)
+#define RLE_SEGMENT (64 << 10) // Smaller segments are not worth a band
+#define RLE_SEGMENTS (MAX_WORKERS * MIN_BAND_ROWS)
+#define RLE_LINE 70 // Golly's line length for RLE bodies
+#define EXPORT_BUFFER (1 << 20)
+
+typedef struct rleJob {
+    const char* text;
+    size_t begin[RLE_SEGMENTS + 1]; // Segment s is text[begin[s]..begin[s + 1])
+    long long rows[RLE_SEGMENTS];   // Rows segment s advances, then the pattern row it starts on
+    bool** field;
+    int size;
+    long long top, left;            // Field cell of pattern cell 0,0, negative when the pattern is clipped
+} rleJob;
+
+static void rleCountRows(void* arg, int begin, int end, int worker) {
+    rleJob* job = (rleJob*)arg;
+    for (int s = begin; s < end; s++) {
+        long long rows = 0, run = 0;
+        for (size_t k = job->begin[s]; k < job->begin[s + 1]; k++) {
+            char c = job->text[k];
+            if (c >= '0' && c <= '9') run = run * 10 + (c - '0');
+            else if (isspace((unsigned char)c)) continue;
+            else {
+                if (c == '$') rows += run ? run : 1;
+                run = 0;
+            }
+        }
+        job->rows[s] = rows;
+    }
+}
+
+static void rleDecode(void* arg, int begin, int end, int worker) {
+    rleJob* job = (rleJob*)arg;
+    for (int s = begin; s < end; s++) {
+        long long row = job->rows[s], column = 0, run = 0;
+        bool prefixed = false; // p..y before a letter mark states above 24
+        for (size_t k = job->begin[s]; k < job->begin[s + 1]; k++) {
+            char c = job->text[k];
+            if (c >= '0' && c <= '9') {
+                run = run * 10 + (c - '0');
+                continue;
+            }
+            if (isspace((unsigned char)c)) continue;
+            if (c >= 'p' && c <= 'y') {
+                prefixed = true;
+                continue;
+            }
+
+            long long count = run ? run : 1;
+            run = 0;
+            if (c == '$') {
+                row += count;
+                column = 0;
+                continue;
+            }
+            if ((c == 'o' || c == 'A') && !prefixed) { // Only state 1 is alive, dying states load as dead
+                long long i = job->top + row;
+                long long from = job->left + column, to = from + count;
+                if (from < 0) from = 0;
+                if (to > job->size) to = job->size;
+                if (i >= 0 && i < job->size && from < to) {
+                    memset(job->field[i] + from, 1, to - from);
+                }
+            }
+            column += count;
+            prefixed = false;
+        }
+    }
+}
+
+static void rleChunk(rleJob* job, const char* text, size_t length, long long* row) {
+    int segments = (int)(length / RLE_SEGMENT);
+    if (segments > pool.count * MIN_BAND_ROWS) segments = pool.count * MIN_BAND_ROWS;
+    if (segments < 1) segments = 1;
+
+    job->text = text;
+    job->begin[0] = 0;
+    for (int s = 1; s < segments; s++) { // Cut just after the first row end past an even split
+        size_t cut = length * s / segments;
+        if (cut < job->begin[s - 1]) cut = job->begin[s - 1];
+        const char* end = (const char*)memchr(text + cut, '$', length - cut);
+        job->begin[s] = end != NULL ? (size_t)(end - text) + 1 : length;
+    }
+    job->begin[segments] = length;
+
+    RunBands(rleCountRows, job, segments);
+    for (int s = 0; s < segments; s++) {
+        long long advance = job->rows[s];
+        job->rows[s] = *row;
+        *row += advance;
+    }
+    RunBands(rleDecode, job, segments);
+}
+
+static void rleHeader(char* line, long long* width, long long* height, char* ruleText) { // x = 3, y = 3, rule = B3/S23
+    for (char* item = line; item != NULL;) {
+        char* equals = strchr(item, '=');
+        if (equals == NULL) break;
+        *equals = '\0';
+        char key[16] = "";
+        sscanf(item, " %15s", key);
+        char* value = equals + 1;
+        while (isspace((unsigned char)*value)) value++;
+        if (strcmp(key, "rule") == 0) { // Larger-than-Life rules hold commas, so the rule runs to the end of the line
+            value[strcspn(value, " \t\r\n:")] = '\0'; // Golly appends bounded grids as :T100,100
+            snprintf(ruleText, RULE_NAME, "%s", value);
+            break;
+        }
+        char* comma = strchr(value, ',');
+        item = comma != NULL ? comma + 1 : NULL;
+        if (comma != NULL) *comma = '\0';
+
+        if (strcmp(key, "x") == 0) *width = atoll(value);
+        else if (strcmp(key, "y") == 0) *height = atoll(value);
+    }
+}
+
+bool ReadRle(const char* filename, bool** field, unsigned short size) { // Replaces the field with the pattern, centred and clipped
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) return false;
+
+    char line[1024];
+    long long width = -1, height = -1;
+    char ruleText[RULE_NAME] = "";
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') continue; // Comments and blank lines
+        rleHeader(line, &width, &height, ruleText);
+        break;
+    }
+    if (width < 0 || height < 0) {
+        fprintf(stderr, "Error: %s has no RLE header\n", filename);
+        fclose(file);
+        return false;
+    }
+    if (ruleText[0] != '\0') {
+        if (ParseRule(ruleText, &activeRule)) printf("Rule: %s\n", activeRule.name);
+        else fprintf(stderr, "Error: unknown rule %s, keeping %s\n", ruleText, activeRule.name);
+    }
+
+    size_t capacity = RLE_CHUNK;
+    char* buffer = (char*)malloc(capacity);
+    rleJob* job = (rleJob*)malloc(sizeof(rleJob));
+    if (buffer == NULL || job == NULL) {
+        free(buffer);
+        free(job);
+        fclose(file);
+        return false;
+    }
+    for (int i = 0; i < size; i++) {
+        memset(field[i], 0, size);
+    }
+    job->field = field;
+    job->size = size;
+    job->top = (size - height) / 2;
+    job->left = (size - width) / 2;
+    if (activeRule.neighbourhood == NEIGHBOURHOOD_HEX) job->top -= job->top & 1; // Hex rows differ by parity, pattern row 0 is an even row
+
+    size_t filled = 0;
+    long long row = 0;
+    for (bool done = false; !done;) {
+        size_t got = fread(buffer + filled, 1, capacity - filled, file);
+        filled += got;
+
+        size_t usable;
+        const char* bang = (const char*)memchr(buffer, '!', filled);
+        if (bang != NULL || got == 0) { // Pattern end, or a file missing its '!'
+            usable = bang != NULL ? (size_t)(bang - buffer) : filled;
+            done = true;
+        } else {
+            usable = filled;
+            while (usable > 0 && buffer[usable - 1] != '$') usable--;
+            if (usable == 0) { // A single row longer than the buffer
+                if (filled == capacity) {
+                    char* grown = (char*)realloc(buffer, capacity * 2);
+                    if (grown == NULL) break;
+                    buffer = grown;
+                    capacity *= 2;
+                }
+                continue;
+            }
+        }
+
+        rleChunk(job, buffer, usable, &row);
+        memmove(buffer, buffer + usable, filled - usable);
+        filled -= usable;
+    }
+
+    printf("Pattern: %s, %lldx%lld\n", filename, width, height);
+    free(buffer);
+    free(job);
+    fclose(file);
+    return true;
+}
+
+typedef struct patternWriter {
+    FILE* file;
+    char* buffer;
+    size_t used;
+    int line;     // Characters on the current RLE line
+    bool failed;
+} patternWriter;
+
+static void writerFlush(patternWriter* writer) {
+    if (writer->used > 0 && fwrite(writer->buffer, 1, writer->used, writer->file) != writer->used) writer->failed = true;
+    writer->used = 0;
+}
+
+static void writerPut(patternWriter* writer, const char* text, size_t length) {
+    if (writer->used + length > EXPORT_BUFFER) writerFlush(writer);
+    memcpy(writer->buffer + writer->used, text, length);
+    writer->used += length;
+}
+
+static inline void writerToken(patternWriter* writer, long long count, char tag) { // "12o", or "o" for a single cell
+    if (writer->used + 32 > EXPORT_BUFFER) writerFlush(writer);
+    char digits[20];
+    int n = 0;
+    if (count > 1) {
+        for (; count > 0; count /= 10) digits[n++] = (char)('0' + count % 10);
+    }
+    if (writer->line + n + 1 > RLE_LINE) {
+        writer->buffer[writer->used++] = '\n';
+        writer->line = 0;
+    }
+    writer->line += n + 1;
+    while (n > 0) writer->buffer[writer->used++] = digits[--n];
+    writer->buffer[writer->used++] = tag;
+}
+
+static int runEnd(const bool* row, int j, int end, bool value) { // First column from j that is not value, at most end
+    uint64_t same = value ? 0x0101010101010101ull : 0;
+    while (j + 8 <= end && loadCells(row + j) == same) j += 8;
+    while (j < end && row[j] == value) j++;
+    return j;
+}
+
+static inline uint64_t liveMask(const bool* row, int j) { // Bit k set when cell j + k is alive, for 64 cells
+    uint64_t mask = 0;
+    for (int k = 0; k < 8; k++) {
+        mask |= ((loadCells(row + j + k * 8) * 0x0102040810204080ull) >> 56) << (k * 8); // Gathers each byte's low bit
+    }
+    return mask;
+}
+
+static int rowEnd(const bool* row, int size) { // One past the last live cell, 0 for an empty row
+    int j = size;
+    while (j >= 8 && loadCells(row + j - 8) == 0) j -= 8;
+    while (j > 0 && !row[j - 1]) j--;
+    return j;
+}
+
+static bool patternBounds(bool** field, int size, int* top, int* bottom, int* left, int* right) { // Live cells' bounding box, false if none
+    *top = -1;
+    *left = size;
+    *right = 0;
+    for (int i = 0; i < size; i++) {
+        int end = rowEnd(field[i], size);
+        if (end == 0) continue;
+        if (*top < 0) *top = i;
+        *bottom = i + 1;
+        int begin = runEnd(field[i], 0, end, false);
+        if (begin < *left) *left = begin;
+        if (end > *right) *right = end;
+    }
+    return *top >= 0;
+}
+
+static bool openWriter(patternWriter* writer, const char* filename) {
+    writer->file = fopen(filename, "wb");
+    writer->buffer = (char*)malloc(EXPORT_BUFFER);
+    writer->used = 0;
+    writer->line = 0;
+    writer->failed = false;
+    if (writer->file != NULL && writer->buffer != NULL) return true;
+    if (writer->file != NULL) fclose(writer->file);
+    free(writer->buffer);
+    return false;
+}
+
+static bool closeWriter(patternWriter* writer) {
+    writerFlush(writer);
+    bool ok = !writer->failed && fclose(writer->file) == 0;
+    free(writer->buffer);
+    return ok;
+}
+
+bool WriteRle(const char* filename, bool** field, unsigned short size) { // Bounding box of the live cells
+    patternWriter writer;
+    if (!openWriter(&writer, filename)) return false;
+
+    int top = 0, bottom = 0, left = 0, right = 0;
+    bool any = patternBounds(field, size, &top, &bottom, &left, &right);
+    if (any && activeRule.neighbourhood == NEIGHBOURHOOD_HEX) top -= top & 1; // Start on an even row, as ReadRle places it
+    char header[RULE_NAME + 64];
+    int length = snprintf(header, sizeof(header), "x = %d, y = %d, rule = %s\n",
+                          any ? right - left : 0, any ? bottom - top : 0, activeRule.name);
+    writerPut(&writer, header, length);
+
+    long long rowEnds = 0; // Pending '$', written before the next live row so blank rows merge
+    for (int i = top; any && i < bottom; i++) {
+        const bool* row = field[i];
+        int end = rowEnd(row, size);
+        if (i > top) rowEnds++;
+        if (end == 0) continue;
+        if (rowEnds > 0) {
+            writerToken(&writer, rowEnds, '$');
+            rowEnds = 0;
+        }
+        bool value = row[left];
+        long long run = 0;
+        for (int j = left; j < end; j += 64) { // Runs end where a 64-cell mask changes, found by counting zeros
+            int valid = end - j < 64 ? end - j : 64;
+            uint64_t changes = value ? ~liveMask(row, j) : liveMask(row, j); // Cells that end the current run
+            for (int k = 0; k < valid;) {
+                int next = changes >> k ? k + __builtin_ctzll(changes >> k) : 64;
+                if (next >= valid) {
+                    run += valid - k;
+                    break;
+                }
+                writerToken(&writer, run + next - k, value ? 'o' : 'b');
+                run = 0;
+                value = !value;
+                changes = ~changes;
+                k = next;
+            }
+        }
+        writerToken(&writer, run, 'o'); // Rows end on a live cell
+    }
+    writerToken(&writer, 1, '!');
+    writerPut(&writer, "\n", 1);
+    return closeWriter(&writer);
+}
+
+bool WriteCells(const char* filename, bool** field, unsigned short size) { // Plaintext, one character per cell, for small fields
+    patternWriter writer;
+    if (!openWriter(&writer, filename)) return false;
+
+    int top = 0, bottom = 0, left = 0, right = 0;
+    bool any = patternBounds(field, size, &top, &bottom, &left, &right);
+    if (any && activeRule.neighbourhood == NEIGHBOURHOOD_HEX) top -= top & 1; // Start on an even row, as WriteRle does
+    char header[RULE_NAME + 32];
+    int length = snprintf(header, sizeof(header), "!Name: %s\n!Rule: %s\n", filename, activeRule.name);
+    writerPut(&writer, header, length < (int)sizeof(header) ? (size_t)length : sizeof(header) - 1); // Long paths are cut
+
+    char* line = (char*)malloc(size + 1);
+    for (int i = top; any && line != NULL && i < bottom; i++) {
+        int end = rowEnd(field[i], size);
+        int count = 0;
+        for (int j = left; j < end; j++) line[count++] = field[i][j] ? 'O' : '.';
+        line[count++] = '\n';
+        writerPut(&writer, line, count);
+    }
+    free(line);
+    return closeWriter(&writer) && (line != NULL || !any);
+}
@@ -0,0 +1,334 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+
+#define RULE_NAME 96
+#define MAX_STATES 16 // Generations rules keep each cell in a 4-bit nibble
+#define MAX_RANGE 100 // Larger-than-Life counts of up to (2 * 100 + 1)^2 cells fit in 16 bits
+
+typedef enum {
+    NEIGHBOURHOOD_MOORE,       // The eight surrounding cells
+    NEIGHBOURHOOD_HEX,         // Six cells of an offset-row hex grid, odd rows sit half a cell right
+    NEIGHBOURHOOD_VON_NEUMANN, // The four orthogonal cells
+} neighbourhoodKind;
+
+typedef struct rule {
+    unsigned short birth;     // Bit n set: a dead cell with n live neighbours is born
+    unsigned short survive;   // Bit n set: a live cell with n live neighbours survives
+    unsigned char next[18];   // Next state indexed by alive * 9 + neighbours
+    unsigned char table[512]; // Next state indexed by the 3x3 neighbourhood, bit 4 the centre
+    bool nonTotalistic;       // Hensel letters make the next state depend on the neighbours' arrangement
+    unsigned char neighbourhood; // neighbourhoodKind, counts above 6 (hex) or 4 (von Neumann) never occur
+    unsigned char states;     // 2 for life-like rules, more for Generations rules with dying states
+    unsigned char range;      // 1 for 3x3 rules, more for Larger-than-Life rules
+    bool middle;              // Larger-than-Life: a cell counts itself
+    unsigned short birthMin, birthMax;     // Larger-than-Life: dead cells with a count in range are born
+    unsigned short surviveMin, surviveMax; // Larger-than-Life: live cells with a count in range survive
+    char name[RULE_NAME];
+} rule;
+
+rule activeRule = {0};
+
+// Hensel notation names each arrangement of n neighbours up to rotation and reflection
+// with a letter, e.g. 2a for two adjacent cells. The arrangements of 8 - n neighbours take
+// the letter of their complement. Rings hold the neighbours clockwise from N in bits 0-7.
+
+#define HENSEL_LETTERS "cekainyqjrtwz"
+
+static const int henselLetterCount[9] = {0, 2, 6, 10, 13, 10, 6, 2, 0};
+static const unsigned char henselShapes[5][13] = { // One arrangement per letter
+    {0},
+    {0x02, 0x01},
+    {0x0a, 0x05, 0x09, 0x03, 0x11, 0x22},
+    {0x2a, 0x15, 0x25, 0x07, 0x83, 0x0b, 0x29, 0x23, 0x43, 0x13},
+    {0xaa, 0x55, 0x4b, 0x0f, 0x1b, 0x8b, 0x2b, 0x27, 0x53, 0x17, 0x93, 0x8d, 0x33},
+};
+static const int ringCells[8] = {1, 2, 5, 8, 7, 6, 3, 0}; // Bit of each ring neighbour in a 3x3 neighbourhood
+
+static unsigned char henselClass[256]; // Letter index of every ring
+static bool henselReady = false;
+
+static void buildHenselClasses(void) {
+    if (henselReady) return;
+    for (int n = 1; n <= 4; n++) {
+        for (int letter = 0; letter < henselLetterCount[n]; letter++) {
+            unsigned ring = henselShapes[n][letter];
+            for (int symmetry = 0; symmetry < 8; symmetry++) {
+                henselClass[ring] = (unsigned char)letter;
+                if (n < 4) henselClass[ring ^ 255] = (unsigned char)letter;
+                if (symmetry == 3) { // Reflect N-S, then the remaining rotations
+                    unsigned mirrored = 0;
+                    for (int k = 0; k < 8; k++) mirrored |= ((ring >> k) & 1) << ((8 - k) & 7);
+                    ring = mirrored;
+                } else {
+                    ring = ((ring << 2) | (ring >> 6)) & 255;
+                }
+            }
+        }
+    }
+    henselReady = true;
+}
+
+static unsigned henselAll(int n) { // Letter mask of every arrangement of n neighbours
+    return n == 0 || n == 8 ? 1 : (1u << henselLetterCount[n]) - 1;
+}
+
+static bool parseConditions(const char* text, int length, bool* rings) { // "23", "2-a3", "3aij4e"
+    buildHenselClasses();
+    for (int i = 0; i < length;) {
+        if (text[i] < '0' || text[i] > '8') return false;
+        int n = text[i++] - '0';
+        bool negate = i < length && text[i] == '-';
+        if (negate) i++;
+
+        unsigned letters = 0;
+        for (; i < length && isalpha((unsigned char)text[i]); i++) {
+            const char* found = strchr(HENSEL_LETTERS, tolower((unsigned char)text[i]));
+            if (found == NULL || found - HENSEL_LETTERS >= henselLetterCount[n]) return false;
+            letters |= 1u << (found - HENSEL_LETTERS);
+        }
+        if (negate && letters == 0) return false;
+        if (letters == 0) letters = henselAll(n);
+        else if (negate) letters = henselAll(n) & ~letters;
+
+        for (unsigned ring = 0; ring < 256; ring++) {
+            if (__builtin_popcount(ring) == n && ((letters >> henselClass[ring]) & 1)) rings[ring] = true;
+        }
+    }
+    return true;
+}
+
+static void formatConditions(char* buffer, const bool* rings) { // Shortest of 3aij and 3-cekny per count
+    for (int n = 0; n <= 8; n++) {
+        unsigned letters = 0;
+        for (unsigned ring = 0; ring < 256; ring++) {
+            if (__builtin_popcount(ring) == n && rings[ring]) letters |= 1u << henselClass[ring];
+        }
+        if (letters == 0) continue;
+        *buffer++ = (char)('0' + n);
+        if (letters == henselAll(n)) continue;
+
+        unsigned missing = henselAll(n) & ~letters;
+        bool negate = __builtin_popcount(missing) < __builtin_popcount(letters);
+        if (negate) *buffer++ = '-';
+        for (int letter = 0; letter < henselLetterCount[n]; letter++) {
+            if (((negate ? missing : letters) >> letter) & 1) *buffer++ = HENSEL_LETTERS[letter];
+        }
+    }
+    *buffer = '\0';
+}
+
+static unsigned neighbourhoodRing(unsigned neighbourhood) {
+    unsigned ring = 0;
+    for (int k = 0; k < 8; k++) ring |= ((neighbourhood >> ringCells[k]) & 1) << k;
+    return ring;
+}
+
+static void formatCounts(char* buffer, unsigned short counts) {
+    for (int n = 0; n <= 8; n++) {
+        if (counts & (1 << n)) *buffer++ = (char)('0' + n);
+    }
+    *buffer = '\0';
+}
+
+void BuildRule(rule* out, unsigned short birth, unsigned short survive, int states) {
+    char born[10], stays[10];
+    memset(out, 0, sizeof(*out)); // The block engine compares rules bytewise
+    out->range = 1;
+    out->birth = birth;
+    out->survive = survive;
+    out->states = (unsigned char)states;
+    for (int n = 0; n <= 8; n++) {
+        out->next[n] = (birth >> n) & 1;
+        out->next[9 + n] = (survive >> n) & 1;
+    }
+    for (unsigned neighbourhood = 0; neighbourhood < 512; neighbourhood++) {
+        out->table[neighbourhood] = out->next[((neighbourhood >> 4) & 1) * 9 + __builtin_popcount(neighbourhood & ~(1u << 4))];
+    }
+    formatCounts(born, birth);
+    formatCounts(stays, survive);
+    if (states > 2) {
+        snprintf(out->name, sizeof(out->name), "B%s/S%s/C%d", born, stays, states);
+    } else {
+        snprintf(out->name, sizeof(out->name), "B%s/S%s", born, stays);
+    }
+}
+
+void BuildIsotropicRule(rule* out, const bool* birthRings, const bool* surviveRings) { // Rings indexed as in parseConditions
+    char born[40], stays[40]; // Letters or their complement, whichever is shorter
+    memset(out, 0, sizeof(*out));
+    out->range = 1;
+    out->states = 2;
+    out->nonTotalistic = true;
+    for (unsigned neighbourhood = 0; neighbourhood < 512; neighbourhood++) {
+        unsigned ring = neighbourhoodRing(neighbourhood);
+        bool alive = (neighbourhood >> 4) & 1;
+        out->table[neighbourhood] = alive ? surviveRings[ring] : birthRings[ring];
+        if (out->table[neighbourhood]) {
+            if (alive) out->survive |= (unsigned short)(1 << __builtin_popcount(ring));
+            else out->birth |= (unsigned short)(1 << __builtin_popcount(ring));
+        }
+    }
+    formatConditions(born, birthRings);
+    formatConditions(stays, surviveRings);
+    snprintf(out->name, sizeof(out->name), "B%s/S%s", born, stays);
+}
+
+void BuildLargerRule(rule* out, int range, bool middle, int birthMin, int birthMax, int surviveMin, int surviveMax) {
+    if (range == 1) { // Same as a 3x3 rule, which the faster engines can run
+        unsigned short birth = 0, survive = 0;
+        for (int n = 0; n <= 8; n++) {
+            if (n >= birthMin && n <= birthMax) birth |= (unsigned short)(1 << n);
+            if (n + middle >= surviveMin && n + middle <= surviveMax) survive |= (unsigned short)(1 << n);
+        }
+        BuildRule(out, birth, survive, 2);
+        return;
+    }
+    memset(out, 0, sizeof(*out));
+    out->states = 2;
+    out->range = (unsigned char)range;
+    out->middle = middle;
+    out->birthMin = (unsigned short)birthMin;
+    out->birthMax = (unsigned short)birthMax;
+    out->surviveMin = (unsigned short)surviveMin;
+    out->surviveMax = (unsigned short)surviveMax;
+    snprintf(out->name, sizeof(out->name), "R%d,C0,M%d,S%d..%d,B%d..%d,NM",
+             range, middle, surviveMin, surviveMax, birthMin, birthMax);
+}
+
+static bool parseInterval(const char* text, int* low, int* high) { // "34..58" or "3"
+    char* end;
+    *low = (int)strtol(text, &end, 10);
+    *high = *low;
+    if (end == text) return false;
+    if (strncmp(end, "..", 2) == 0) {
+        const char* second = end + 2;
+        *high = (int)strtol(second, &end, 10);
+        if (end == second) return false;
+    }
+    return (*end == ',' || *end == '\0') && *low >= 0 && *low <= *high;
+}
+
+static bool parseLargerRule(const char* text, rule* out) { // Golly's R5,C0,M1,S34..58,B34..45,NM
+    int range = 0, states = 0, middle = 0;
+    int birthMin = -1, birthMax = -1, surviveMin = -1, surviveMax = -1;
+
+    for (const char* part = text; *part != '\0';) {
+        char kind = (char)toupper((unsigned char)part[0]);
+        const char* value = part + 1;
+        char* end = (char*)value;
+        if (kind == 'R') range = (int)strtol(value, &end, 10);
+        else if (kind == 'C') states = (int)strtol(value, &end, 10);
+        else if (kind == 'M') middle = (int)strtol(value, &end, 10);
+        else if (kind == 'S' && parseInterval(value, &surviveMin, &surviveMax)) end = (char*)value + strcspn(value, ",");
+        else if (kind == 'B' && parseInterval(value, &birthMin, &birthMax)) end = (char*)value + strcspn(value, ",");
+        else if (kind == 'N' && toupper((unsigned char)*value) == 'M') end++; // Moore neighbourhood only
+        else return false;
+
+        if (end == value || (*end != ',' && *end != '\0')) return false;
+        part = *end == ',' ? end + 1 : end;
+    }
+
+    int cells = (2 * range + 1) * (2 * range + 1);
+    if (range < 1 || range > MAX_RANGE || states > 2 || (middle != 0 && middle != 1)) return false;
+    if (birthMin < 0 || surviveMin < 0 || birthMax > cells || surviveMax > cells) return false;
+    BuildLargerRule(out, range, middle, birthMin, birthMax, surviveMin, surviveMax);
+    return true;
+}
+
+unsigned NeighbourMask(neighbourhoodKind kind, int row) { // Bits of the 3x3 neighbourhood a cell on this row sees, centre included
+    switch (kind) {
+    case NEIGHBOURHOOD_HEX: return row & 1 ? 0x1be : 0x0fb; // Odd rows see N, NE, S, SE; even rows NW, N, SW, S
+    case NEIGHBOURHOOD_VON_NEUMANN: return 0x0ba;
+    default: return 0x1ff;
+    }
+}
+
+bool RuleApply(const rule* rule, unsigned neighbourhood, int row) { // 3x3 cells row-major, bit 4 is the centre
+    return rule->table[neighbourhood & NeighbourMask((neighbourhoodKind)rule->neighbourhood, row)];
+}
+
+bool ParseRule(const char* rawText, rule* out) { // Accepts B3/S23, S23/B3, 23/3, B2-a/S12, B2/S/C3 or /2/3 for Generations, R5,... for Larger-than-Life
+    if ((rawText[0] == 'R' || rawText[0] == 'r') && isdigit((unsigned char)rawText[1])) return parseLargerRule(rawText, out);
+
+    char text[RULE_NAME]; // Without the H (hex) or V (von Neumann) suffix
+    int textLength = snprintf(text, sizeof(text), "%s", rawText);
+    if (textLength <= 0 || textLength >= (int)sizeof(text)) return false;
+    neighbourhoodKind kind = NEIGHBOURHOOD_MOORE;
+    char suffix = (char)toupper((unsigned char)text[textLength - 1]);
+    if (suffix == 'H' || suffix == 'V') {
+        kind = suffix == 'H' ? NEIGHBOURHOOD_HEX : NEIGHBOURHOOD_VON_NEUMANN;
+        text[--textLength] = '\0';
+    }
+
+    bool birthRings[256] = {false}, surviveRings[256] = {false};
+    int states = 2;
+    const char* parts[3];
+    int lengths[3];
+    int count = 0;
+
+    for (const char* part = text; count < 3; count++) {
+        const char* slash = strchr(part, '/');
+        parts[count] = part;
+        lengths[count] = slash != NULL ? (int)(slash - part) : (int)strlen(part);
+        if (slash == NULL) {
+            count++;
+            break;
+        }
+        part = slash + 1;
+    }
+    if (count < 2 || (count == 3 && strchr(parts[2], '/') != NULL)) return false;
+
+    bool lettered = false;
+    for (int i = 0; i < count; i++) {
+        if (lengths[i] > 0 && isalpha((unsigned char)parts[i][0])) lettered = true;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const char* part = parts[i];
+        int length = lengths[i];
+        char kind = i == 0 ? 'S' : i == 1 ? 'B' : 'C';
+        if (lettered) {
+            if (length == 0) return false;
+            kind = (char)toupper((unsigned char)part[0]);
+            part++;
+            length--;
+        }
+        if (kind == 'B' || kind == 'S') {
+            if (!parseConditions(part, length, kind == 'B' ? birthRings : surviveRings)) return false;
+        }
+        else if (kind == 'C' || kind == 'G') {
+            states = atoi(part);
+            if (states < 2 || states > MAX_STATES) return false;
+        }
+        else {
+            return false;
+        }
+    }
+
+    unsigned short birth = 0, survive = 0;
+    bool totalistic = true;
+    for (unsigned ring = 0; ring < 256; ring++) { // Totalistic when every count is all or nothing
+        int n = __builtin_popcount(ring);
+        if (birthRings[ring] != birthRings[(1u << n) - 1] || surviveRings[ring] != surviveRings[(1u << n) - 1]) totalistic = false;
+        if (birthRings[ring]) birth |= (unsigned short)(1 << n);
+        if (surviveRings[ring]) survive |= (unsigned short)(1 << n);
+    }
+    if (totalistic) {
+        int most = kind == NEIGHBOURHOOD_HEX ? 6 : kind == NEIGHBOURHOOD_VON_NEUMANN ? 4 : 8;
+        if ((birth | survive) >> (most + 1)) return false;
+        BuildRule(out, birth, survive, states);
+    } else {
+        if (states > 2 || kind != NEIGHBOURHOOD_MOORE) return false; // Hensel letters describe Moore neighbourhoods only
+        BuildIsotropicRule(out, birthRings, surviveRings);
+    }
+    if (kind != NEIGHBOURHOOD_MOORE) {
+        out->neighbourhood = (unsigned char)kind;
+        size_t length = strlen(out->name);
+        snprintf(out->name + length, sizeof(out->name) - length, "%c", suffix);
+    }
+    return true;
+}
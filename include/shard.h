@@ -0,0 +1,377 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#ifdef __linux__
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+#endif
+#include "threads.h"
+#include "cells.h"
+#include "cycle.h"
+#include "pages.h"
+#include "random.h"
+#include "rules.h"
+#include "stats.h"
+#include "topology.h"
+
+// Sharded runs: the field split into bands of rows, each owned by its own process on this
+// host, for fields larger than one process may hold. A shard keeps its rows plus `depth`
+// halo rows above and below, depth being the rule's range, and steps them with StepRows,
+// the kernels NextStep uses, so generations, populations and hashes match a single-process
+// run. Each generation a shard publishes its edge rows into a shared mapping, two slots per
+// edge alternating with the generation, meets the others at a futex barrier, then copies
+// its neighbours' edges into its halo. One barrier per generation is enough: a shard only
+// reuses a slot after everyone passed the barrier that follows the read of it. Shards
+// publish their population and hash the same way, so all of them see the totals and stop
+// at the same cycle. Linux only; plane, torus and klein topologies, two-state rules.
+
+#define MAX_SHARDS 64
+#define SHARD_SPIN 4096 // Barrier polls before sleeping on the futex
+
+typedef struct shardConfig {
+    int shards;
+    int workers;                    // Per shard, 0 shares the cores between shards
+    int size;
+    const rule* rule;
+    topology kind;
+    unsigned long long generations; // 0 runs until the field repeats
+    int history;                    // Cycle detection window, 0 disables
+    unsigned long long reportEvery; // Generations between progress lines, 0 disables
+    bool fill;                      // Start from a random fill instead of the glider
+    double density;
+    uint64_t seed;
+} shardConfig;
+
+typedef struct shardBarrier {
+    _Alignas(64) _Atomic uint32_t arrived;
+    _Alignas(64) _Atomic uint32_t phase; // The futex word, moves on when the last shard arrives
+} shardBarrier;
+
+typedef struct shardTimes {
+    _Alignas(64) uint64_t stepNs;
+    uint64_t exchangeNs;            // Publishing edges and loading the halo
+    uint64_t waitNs;                // At the barrier, waiting for slower shards
+    uint64_t slowestNs;             // Longest single step
+    unsigned long long generations;
+} shardTimes;
+
+typedef struct shardShared {        // Mapped before the shards fork, edge rows follow it
+    shardBarrier barrier;
+    shardTimes times[MAX_SHARDS];
+    stepResult totals[2][MAX_SHARDS]; // Each shard's population and hash, by generation parity
+} shardShared;
+
+typedef struct shardField {
+    size_t stride;
+    size_t mapped;
+    char* block;                    // Halo rows, the shard's rows, halo rows
+    bool** rows;                    // By field row from -1 to size, only the shard's rows and its halo are set
+} shardField;
+
+typedef struct shardRun {
+    const shardConfig* config;
+    shardShared* shared;
+    int index;
+    int begin, end;
+    int depth;
+} shardRun;
+
+static int shardBegin(const shardConfig* config, int shard) {
+    return (int)((long long)config->size * shard / config->shards);
+}
+
+static int shardDepth(const rule* rule) {
+    return rule->range > 1 ? rule->range : 1;
+}
+
+static bool* shardEdge(const shardRun* run, int shard, int slot, bool bottom) { // depth rows of size cells
+    size_t rows = (size_t)run->depth * run->config->size;
+    return (bool*)(run->shared + 1) + (((size_t)shard * 2 + slot) * 2 + bottom) * rows;
+}
+
+static bool createShardField(shardField* field, const shardRun* run) {
+    int size = run->config->size;
+    int count = run->end - run->begin + 2 * run->depth;
+    field->stride = FIELD_LEAD + ((size_t)size + 2 + 63) / 64 * 64; // As CreateField lays rows out
+    field->block = (char*)AllocPages(field->stride * count, &field->mapped);
+    field->rows = (bool**)calloc(size + 2, sizeof(bool*));
+    if (field->block == NULL || field->rows == NULL) return false;
+    memset(field->block, 0, field->stride * count);
+
+    bool** rows = field->rows + 1;
+    for (int k = 0; k < count; k++) { // Halo rows first, the range-1 kernels read rows -1 and size, wider ones wrap
+        int i = run->begin - run->depth + k;
+        bool* row = (bool*)(field->block + field->stride * k + FIELD_LEAD);
+        if (i == -1 || i == size) rows[i] = row;
+        // A plane's kernels never wrap, and its dead rows past the edge must not take the place
+        // of the real halo row they wrap onto when the other shards hold fewer than 2 * depth
+        // rows. Wrapping topologies may map one row from both sides, it is the same row then.
+        if (run->config->kind != TOPOLOGY_PLANE || (i >= 0 && i < size)) rows[wrapIndex(i, size)] = row;
+    }
+    for (int i = run->begin; i < run->end; i++) {
+        rows[i] = (bool*)(field->block + field->stride * (i - run->begin + run->depth) + FIELD_LEAD);
+    }
+    return true;
+}
+
+static void freeShardField(shardField* field) {
+    if (field->block != NULL) FreePages(field->block, field->mapped);
+    free(field->rows);
+    memset(field, 0, sizeof(*field));
+}
+
+static bool* shardRow(const shardField* field, int k) { // Row k of the block
+    return (bool*)(field->block + field->stride * k + FIELD_LEAD);
+}
+
+static void publishEdges(const shardRun* run, const shardField* field, int slot) {
+    int size = run->config->size;
+    int rows = run->end - run->begin;
+    bool* top = shardEdge(run, run->index, slot, false);
+    bool* bottom = shardEdge(run, run->index, slot, true);
+    for (int d = 0; d < run->depth; d++) {
+        memcpy(top + (size_t)d * size, shardRow(field, run->depth + d), size);
+        memcpy(bottom + (size_t)d * size, shardRow(field, rows + d), size);
+    }
+}
+
+static void loadEdge(const shardRun* run, const bool* edge, bool* row, bool across) { // across: the edge comes over the field's border
+    int size = run->config->size;
+    topology kind = run->config->kind;
+    if (across && kind == TOPOLOGY_PLANE) return; // Stays dead
+    if (across && kind == TOPOLOGY_KLEIN && run->config->rule->range <= 1) { // Wider rules wrap like a torus, as in NextStep
+        for (int j = 0; j < size; j++) row[j] = edge[size - 1 - j];
+    } else {
+        memcpy(row, edge, size);
+    }
+}
+
+static void loadHalo(const shardRun* run, shardField* field, int slot) {
+    int size = run->config->size;
+    int shards = run->config->shards;
+    int rows = run->end - run->begin;
+    const bool* above = shardEdge(run, (run->index + shards - 1) % shards, slot, true);
+    const bool* below = shardEdge(run, (run->index + 1) % shards, slot, false);
+    for (int d = 0; d < run->depth; d++) {
+        loadEdge(run, above + (size_t)d * size, shardRow(field, d), run->index == 0);
+        loadEdge(run, below + (size_t)d * size, shardRow(field, run->depth + rows + d), run->index == shards - 1);
+    }
+    bool wrap = run->config->kind != TOPOLOGY_PLANE; // Klein only twists rows, columns wrap as on a torus
+    for (int k = 0; k < rows + 2 * run->depth; k++) {
+        bool* row = shardRow(field, k);
+        row[-1] = wrap && row[size - 1];
+        row[size] = wrap && row[0];
+    }
+}
+
+#ifdef __linux__
+static void futexWait(_Atomic uint32_t* word, uint32_t value) { // Shared between processes, so not FUTEX_PRIVATE
+    syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+static void futexWake(_Atomic uint32_t* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void shardBarrierWait(shardBarrier* barrier, int parties) {
+    uint32_t phase = atomic_load(&barrier->phase); // Cannot move on before this shard arrives
+    if (atomic_fetch_add(&barrier->arrived, 1) + 1 == (uint32_t)parties) {
+        atomic_store(&barrier->arrived, 0);
+        atomic_store(&barrier->phase, phase + 1);
+        futexWake(&barrier->phase);
+        return;
+    }
+    for (int spin = 0; spin < SHARD_SPIN && atomic_load(&barrier->phase) == phase; spin++) {}
+    while (atomic_load(&barrier->phase) == phase) futexWait(&barrier->phase, phase);
+}
+
+static int runShard(const shardConfig* config, shardShared* shared, int index) { // The exit status of the shard's process
+    shardRun run = {config, shared, index, shardBegin(config, index), shardBegin(config, index + 1), shardDepth(config->rule)};
+    int size = config->size;
+    int workers = config->workers > 0 ? config->workers : DetectWorkers() / config->shards;
+    StartWorkers(workers > 0 ? workers : 1);
+
+    shardField fields[2] = {{0}};
+    if (!createShardField(&fields[0], &run) || !createShardField(&fields[1], &run)) {
+        fprintf(stderr, "Error: shard %d cannot allocate rows %d-%d\n", index, run.begin, run.end - 1);
+        return 1;
+    }
+    bool** current = fields[0].rows + 1;
+    bool** next = fields[1].rows + 1;
+    if (config->fill) {
+        FillRandomRows(current, size, run.begin, run.end - run.begin, config->density, config->seed);
+    } else { // The glider single-process runs start from
+        static const int glider[5][2] = {{1, 2}, {2, 3}, {3, 1}, {3, 2}, {3, 3}};
+        for (int c = 0; c < 5; c++) {
+            int i = glider[c][0], j = glider[c][1];
+            if (i >= run.begin && i < run.end && j < size) current[i][j] = 1;
+        }
+    }
+    stepResult own = {0, 0};
+    for (int i = run.begin; i < run.end; i++) own.hash += scanRow(current[i], size, i, &own.population);
+    shared->totals[0][index] = own;
+
+    cycleDetector cycles;
+    CreateCycleDetector(&cycles, config->history);
+    shardTimes times = {0};
+    stepResult total = {0, 0};
+    unsigned long long generation = 0;
+    for (;; generation++) {
+        int slot = (int)(generation & 1);
+        uint64_t start = MonotonicNs();
+        publishEdges(&run, &fields[slot], slot); // Fields swap every generation, so the slot is also the current one
+        uint64_t arrived = MonotonicNs();
+        shardBarrierWait(&shared->barrier, config->shards);
+        uint64_t passed = MonotonicNs();
+        times.exchangeNs += arrived - start;
+        times.waitNs += passed - arrived;
+
+        total = (stepResult){0, 0};
+        for (int s = 0; s < config->shards; s++) {
+            total.population += shared->totals[slot][s].population;
+            total.hash += shared->totals[slot][s].hash;
+        }
+        if (index == 0 && config->reportEvery != 0 && generation != 0 && generation % config->reportEvery == 0) {
+            printf("Shards: generation %llu, population %lld\n", generation, total.population);
+            fflush(stdout);
+        }
+        if (config->history > 0 && ObserveGeneration(&cycles, generation, total.hash)) { // Every shard sees the same totals, so all stop here
+            if (index == 0) printf("Cycle: generation %llu repeats generation %llu, period %llu\n", generation, cycles.since, cycles.period);
+            break;
+        }
+        if (config->generations != 0 && generation >= config->generations) break;
+
+        loadHalo(&run, &fields[slot], slot);
+        uint64_t loaded = MonotonicNs();
+        stepResult result = StepRows(config->rule, current, next, size, run.begin, run.end - run.begin);
+        uint64_t stepped = MonotonicNs();
+        shared->totals[slot ^ 1][index] = result;
+        bool** swap = current;
+        current = next;
+        next = swap;
+
+        times.exchangeNs += loaded - passed;
+        times.stepNs += stepped - loaded;
+        if (stepped - loaded > times.slowestNs) times.slowestNs = stepped - loaded;
+        times.generations++;
+    }
+    if (index == 0) printf("Shards: generation %llu, population %lld, hash %016llx\n", generation, total.population, (unsigned long long)total.hash);
+    shared->times[index] = times;
+
+    FreeCycleDetector(&cycles);
+    freeShardField(&fields[0]);
+    freeShardField(&fields[1]);
+    StopWorkers();
+    return 0;
+}
+
+static void reportShards(const shardConfig* config, const shardShared* shared) { // Per-shard timing, the busiest shard holds the others up
+    double mean = 0;
+    int straggler = 0;
+    for (int s = 0; s < config->shards; s++) {
+        const shardTimes* times = &shared->times[s];
+        uint64_t busy = times->stepNs + times->exchangeNs;
+        mean += (double)busy / config->shards;
+        if (busy > shared->times[straggler].stepNs + shared->times[straggler].exchangeNs) straggler = s;
+        printf("Shard %d: rows %d-%d, %llu generations, step %.1f ms (slowest %.3f ms), exchange %.1f ms, waiting %.1f ms\n",
+               s, shardBegin(config, s), shardBegin(config, s + 1) - 1, times->generations,
+               times->stepNs / 1e6, times->slowestNs / 1e6, times->exchangeNs / 1e6, times->waitNs / 1e6);
+    }
+    const shardTimes* slowest = &shared->times[straggler];
+    if (mean > 0) {
+        printf("Shards: shard %d is the slowest, busy %.0f%% above the mean\n",
+               straggler, ((slowest->stepNs + slowest->exchangeNs) / mean - 1) * 100);
+    }
+}
+#endif
+
+bool RunShards(const shardConfig* config) { // Forks the shards and waits for them; false if the run cannot start or a shard fails
+#ifdef __linux__
+    int depth = shardDepth(config->rule);
+    if (config->shards < 2 || config->shards > MAX_SHARDS) {
+        fprintf(stderr, "Error: shards must be between 2 and %d\n", MAX_SHARDS);
+        return false;
+    }
+    if (config->rule->states > 2) {
+        fprintf(stderr, "Error: sharded runs need a two-state rule\n");
+        return false;
+    }
+    if (config->kind != TOPOLOGY_PLANE && config->kind != TOPOLOGY_TORUS && config->kind != TOPOLOGY_KLEIN) {
+        fprintf(stderr, "Error: sharded runs support the plane, torus and klein topologies\n");
+        return false;
+    }
+    if (config->size / config->shards < depth) { // The halo must come from the next shard alone
+        fprintf(stderr, "Error: %d shards leave fewer than %d rows each\n", config->shards, depth);
+        return false;
+    }
+
+    size_t bytes = sizeof(shardShared) + (size_t)config->shards * 4 * depth * config->size;
+    shardShared* shared = (shardShared*)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map %zu bytes for shard exchange\n", bytes);
+        return false;
+    }
+    if (config->fill) {
+        printf("Fill: %dx%d at 0,0, density %.3g, seed %llu\n", config->size, config->size, config->density, (unsigned long long)config->seed);
+    }
+    fflush(stdout); // Shards inherit the buffers
+    fflush(stderr);
+
+    pid_t pids[MAX_SHARDS];
+    int started = 0;
+    bool ok = true;
+    for (; started < config->shards; started++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            int status = runShard(config, shared, started);
+            fflush(stdout);
+            _exit(status);
+        }
+        if (pid < 0) {
+            fprintf(stderr, "Error: cannot start shard %d\n", started);
+            ok = false;
+            break;
+        }
+        pids[started] = pid;
+    }
+    if (!ok) { // The others would wait at the barrier for good
+        for (int s = 0; s < started; s++) kill(pids[s], SIGKILL);
+    }
+    for (int remaining = started; remaining > 0;) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) break;
+        int shard = -1;
+        for (int s = 0; s < started; s++) {
+            if (pids[s] == pid) shard = s;
+        }
+        if (shard < 0) continue;
+        remaining--;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) continue;
+        if (ok) {
+            fprintf(stderr, "Error: shard %d failed, stopping the others\n", shard);
+            for (int s = 0; s < started; s++) {
+                if (s != shard) kill(pids[s], SIGKILL);
+            }
+        }
+        ok = false;
+    }
+
+    if (ok) reportShards(config, shared);
+    munmap(shared, bytes);
+    return ok;
+#else
+    (void)config;
+    fprintf(stderr, "Error: sharded runs need Linux\n");
+    return false;
+#endif
+}
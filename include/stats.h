@@ -0,0 +1,126 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "pages.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#define LATENCY_BUCKETS 160 // Four buckets per power of two, up to ~35 minutes
+
+// Counters have one writer (the step loop) and are read by the metrics thread,
+// so relaxed loads and stores are enough and compile to plain moves.
+#define STAT_GET(name) atomic_load_explicit(&stats.name, memory_order_relaxed)
+#define STAT_SET(name, value) atomic_store_explicit(&stats.name, (value), memory_order_relaxed)
+#define STAT_ADD(name, value) STAT_SET(name, STAT_GET(name) + (value))
+
+typedef struct stepStats {
+    _Atomic unsigned long long generation;
+    _Atomic long long population;
+    _Atomic unsigned long long steps;
+    _Atomic unsigned long long totalNs;
+    _Atomic unsigned long long maxNs;
+    _Atomic unsigned long long latency[LATENCY_BUCKETS];
+    _Atomic uint64_t checkpointNs; // Last slot or saved-field write, 0 if none
+    _Atomic unsigned long long cyclePeriod; // 0 until the field repeats
+    _Atomic unsigned long long cycleSince;
+    _Atomic unsigned long long historyBytes; // Rewind log and edit history
+    uint64_t startNs;
+    int nodes;
+    size_t nodeBytes[MAX_NODES];
+} stepStats;
+
+stepStats stats = {0};
+
+uint64_t MonotonicNs(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency = {0};
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000000ull
+         + (uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000000ull / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+static int latencyBucket(uint64_t ns) {
+    if (ns < 4) return (int)ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    int bucket = (exponent - 1) * 4 + (int)((ns >> (exponent - 2)) & 3);
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+uint64_t BucketLimit(int bucket) { // Largest latency that lands in the bucket
+    if (bucket < 4) return (uint64_t)bucket;
+    int exponent = bucket / 4 + 1;
+    return ((uint64_t)(4 + bucket % 4 + 1) << (exponent - 2)) - 1;
+}
+
+void RecordStep(uint64_t ns, long long population) {
+    STAT_ADD(generation, 1);
+    STAT_SET(population, population);
+    STAT_ADD(steps, 1);
+    STAT_ADD(totalNs, ns);
+    if (ns > STAT_GET(maxNs)) STAT_SET(maxNs, ns);
+    STAT_ADD(latency[latencyBucket(ns)], 1);
+}
+
+void MarkCheckpoint(void) {
+    STAT_SET(checkpointNs, MonotonicNs());
+}
+
+uint64_t LatencyPercentile(double percentile) {
+    unsigned long long steps = STAT_GET(steps);
+    unsigned long long maxNs = STAT_GET(maxNs);
+    if (steps == 0) return 0;
+    unsigned long long rank = (unsigned long long)(percentile / 100.0 * (steps - 1)) + 1;
+    unsigned long long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += STAT_GET(latency[i]);
+        if (seen >= rank) return BucketLimit(i) < maxNs ? BucketLimit(i) : maxNs;
+    }
+    return maxNs;
+}
+
+double GenerationsPerSecond(void) {
+    double elapsed = (MonotonicNs() - stats.startNs) / 1e9;
+    return elapsed > 0 ? STAT_GET(steps) / elapsed : 0;
+}
+
+void FormatStatsLine(char* buffer, size_t length) {
+    snprintf(buffer, length, "gen %llu | pop %lld | step p50 %.1f us p99 %.1f us max %.1f us | %.0f gen/s",
+             STAT_GET(generation), STAT_GET(population),
+             LatencyPercentile(50) / 1e3, LatencyPercentile(99) / 1e3, STAT_GET(maxNs) / 1e3,
+             GenerationsPerSecond());
+}
+
+bool WriteStats(const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) return false;
+
+    fprintf(file, "{\n");
+    unsigned long long steps = STAT_GET(steps);
+    fprintf(file, "  \"generation\": %llu,\n", STAT_GET(generation));
+    fprintf(file, "  \"population\": %lld,\n", STAT_GET(population));
+    fprintf(file, "  \"generationsPerSecond\": %.3f,\n", GenerationsPerSecond());
+    fprintf(file, "  \"cycle\": {\"period\": %llu, \"since\": %llu},\n", STAT_GET(cyclePeriod), STAT_GET(cycleSince));
+    fprintf(file, "  \"stepNs\": {\"count\": %llu, \"mean\": %llu, \"p50\": %llu, \"p99\": %llu, \"max\": %llu},\n",
+            steps, steps ? STAT_GET(totalNs) / steps : 0,
+            (unsigned long long)LatencyPercentile(50), (unsigned long long)LatencyPercentile(99), STAT_GET(maxNs));
+    fprintf(file, "  \"memoryBytes\": %zu,\n", (size_t)pagesInUse);
+    fprintf(file, "  \"historyBytes\": %llu,\n", STAT_GET(historyBytes));
+    fprintf(file, "  \"nodeBytes\": [");
+    for (int node = 0; node < stats.nodes; node++) {
+        fprintf(file, node ? ", %zu" : "%zu", stats.nodeBytes[node]);
+    }
+    fprintf(file, "]\n}\n");
+    fclose(file);
+    return true;
+}
@@ -0,0 +1,242 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "pages.h"
+#include "trace.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define MAX_WORKERS 64
+#define MIN_BAND_ROWS 16 // Smaller bands cost more in wakeups than they save
+
+typedef void (*bandFunc)(void* arg, int begin, int end, int worker);
+typedef void (*taskFunc)(void* arg, int task, int worker);
+
+typedef struct taskQueue {      // A worker's tasks not yet started, begin << 32 | end
+    _Alignas(64) _Atomic uint64_t range;
+} taskQueue;
+
+typedef struct taskJob {
+    taskFunc func;
+    void* arg;
+    taskQueue queues[MAX_WORKERS];
+} taskJob;
+
+typedef struct workerPool {
+    pthread_t threads[MAX_WORKERS];
+    int count;                  // Workers including the calling thread
+    int planned;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    unsigned long job;
+    int pending;
+    bool quit;
+    bandFunc func;
+    void* arg;
+    int rows;
+    int active;
+} workerPool;
+
+static workerPool pool = {.count = 1, .planned = 1};
+
+int DetectWorkers(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int count = (int)info.dwNumberOfProcessors;
+#else
+    int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (count < 1) count = 1;
+    if (count > MAX_WORKERS) count = MAX_WORKERS;
+    return count;
+}
+
+int ActiveBands(int rows) { // Same split for every pass over the same rows, so bands stay on their node
+    int active = rows / MIN_BAND_ROWS;
+    if (active > pool.count) active = pool.count;
+    if (active < 1) active = 1;
+    return active;
+}
+
+void BandRange(int rows, int bands, int band, int* begin, int* end) {
+    *begin = (int)((long long)rows * band / bands);
+    *end = (int)((long long)rows * (band + 1) / bands);
+}
+
+static void PinWorker(int worker) { // Spreads workers over nodes in band order for first-touch placement
+    int nodes = NumaNodeCount();
+    if (placement != PLACEMENT_FIRST_TOUCH || nodes < 2) return;
+    PinToNode((int)((long long)worker * nodes / pool.planned));
+}
+
+static void* workerMain(void* arg) {
+    int index = (int)(intptr_t)arg;
+    unsigned long seen = 0;
+    char label[32];
+    snprintf(label, sizeof(label), "worker %d", index);
+    TraceThread(label);
+    PinWorker(index);
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.job == seen && !pool.quit) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        if (pool.quit) break;
+        seen = pool.job;
+        bandFunc func = pool.func;
+        void* funcArg = pool.arg;
+        int rows = pool.rows;
+        int active = pool.active;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (index < active) {
+            int begin, end;
+            BandRange(rows, active, index, &begin, &end);
+            TRACE_SCOPE("band");
+            func(funcArg, begin, end, index);
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.pending == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+void StartWorkers(int count) {
+    if (count < 1) count = DetectWorkers();
+    if (count > MAX_WORKERS) count = MAX_WORKERS;
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.count = 1;
+    pool.planned = count;
+    PinWorker(0); // The calling thread runs band 0
+
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(&pool.threads[i], NULL, workerMain, (void*)(intptr_t)i) != 0) {
+            break;
+        }
+        pool.count++;
+    }
+}
+
+static void dispatchBands(bandFunc func, void* arg, int rows, int active) { // Band 0 runs on the caller
+    pthread_mutex_lock(&pool.lock);
+    pool.func = func;
+    pool.arg = arg;
+    pool.rows = rows;
+    pool.active = active;
+    pool.pending = pool.count - 1;
+    pool.job++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    {
+        int begin, end;
+        BandRange(rows, active, 0, &begin, &end);
+        TRACE_SCOPE("band");
+        func(arg, begin, end, 0);
+    }
+
+    TRACE_SCOPE("wait");
+    pthread_mutex_lock(&pool.lock);
+    while (pool.pending > 0) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void RunBands(bandFunc func, void* arg, int rows) { // Splits rows into bands, band 0 runs on the caller
+    int active = ActiveBands(rows);
+    if (active == 1) {
+        TRACE_SCOPE("band");
+        func(arg, 0, rows, 0);
+        return;
+    }
+    dispatchBands(func, arg, rows, active);
+}
+
+static bool takeTask(taskQueue* queue, int* task) { // The owner's next task, from the front
+    uint64_t range = atomic_load_explicit(&queue->range, memory_order_relaxed);
+    while ((uint32_t)(range >> 32) < (uint32_t)range) {
+        if (atomic_compare_exchange_weak_explicit(&queue->range, &range, range + (1ull << 32), memory_order_relaxed, memory_order_relaxed)) {
+            *task = (int)(range >> 32);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool stealTask(taskJob* job, int thief, int* task) { // Takes the back half of the fullest queue, runs its first task and keeps the rest
+    while (true) {
+        int victim = -1;
+        uint64_t range = 0;
+        uint32_t most = 0;
+        for (int k = 1; k < pool.count; k++) {
+            int other = (thief + k) % pool.count;
+            uint64_t r = atomic_load_explicit(&job->queues[other].range, memory_order_relaxed);
+            uint32_t begin = (uint32_t)(r >> 32), end = (uint32_t)r;
+            if (begin < end && end - begin > most) {
+                victim = other;
+                range = r;
+                most = end - begin;
+            }
+        }
+        if (victim < 0) return false;
+        uint32_t begin = (uint32_t)(range >> 32), end = (uint32_t)range, split = end - (most + 1) / 2;
+        if (atomic_compare_exchange_strong_explicit(&job->queues[victim].range, &range, (uint64_t)begin << 32 | split, memory_order_relaxed, memory_order_relaxed)) {
+            atomic_store_explicit(&job->queues[thief].range, (uint64_t)(split + 1) << 32 | end, memory_order_relaxed);
+            *task = (int)split;
+            return true;
+        }
+    }
+}
+
+static void runTasks(void* arg, int begin, int end, int worker) {
+    taskJob* job = (taskJob*)arg;
+    int task;
+    while (takeTask(&job->queues[worker], &task) || stealTask(job, worker, &task)) {
+        job->func(job->arg, task, worker);
+    }
+}
+
+void RunTasks(taskFunc func, void* arg, int tasks) { // Tasks 0 to tasks - 1 split evenly, idle workers steal from the busiest
+    if (pool.count == 1 || tasks < 2) {
+        for (int i = 0; i < tasks; i++) func(arg, i, 0);
+        return;
+    }
+    taskJob job;
+    job.func = func;
+    job.arg = arg;
+    for (int i = 0; i < pool.count; i++) {
+        int begin, end;
+        BandRange(tasks, pool.count, i, &begin, &end);
+        atomic_store_explicit(&job.queues[i].range, (uint64_t)begin << 32 | (uint32_t)end, memory_order_relaxed);
+    }
+    dispatchBands(runTasks, &job, pool.count, pool.count);
+}
+
+void StopWorkers(void) {
+    if (pool.count <= 1) return;
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = true;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 1; i < pool.count; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    pool.count = 1;
+}
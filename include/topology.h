@@ -0,0 +1,89 @@
+#pragma once
+#include <stdbool.h>
+#include <string.h>
+
+// Fields carry a one-cell halo around them (rows -1 and size, columns -1 and size). The
+// halo is filled from the field before each step according to the topology, so the step
+// kernels read their neighbours directly and never wrap.
+
+typedef enum {
+    TOPOLOGY_PLANE,  // Dead cells beyond the border
+    TOPOLOGY_TORUS,  // Both edge pairs joined
+    TOPOLOGY_KLEIN,  // Left and right joined, top and bottom joined with a twist
+    TOPOLOGY_CROSS,  // Cross-surface: both edge pairs joined with a twist
+    TOPOLOGY_SPHERE, // Top joined to left, bottom joined to right
+    TOPOLOGY_COUNT,
+} topology;
+
+const char* topologyNames[TOPOLOGY_COUNT] = {"plane", "torus", "klein", "cross", "sphere"};
+topology activeTopology = TOPOLOGY_TORUS;
+
+bool ParseTopology(const char* value, topology* out) {
+    for (int i = 0; i < TOPOLOGY_COUNT; i++) {
+        if (strcmp(value, topologyNames[i]) == 0) {
+            *out = (topology)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline int wrapIndex(int index, int size) {
+    return index < 0 ? index + size : index >= size ? index - size : index;
+}
+
+static bool haloSource(topology kind, int size, int* i, int* j) { // Maps a halo cell to the cell it shows, false if it is dead
+    bool rowOut = *i < 0 || *i >= size;
+    bool columnOut = *j < 0 || *j >= size;
+    switch (kind) {
+    case TOPOLOGY_TORUS:
+        *i = wrapIndex(*i, size);
+        *j = wrapIndex(*j, size);
+        return true;
+    case TOPOLOGY_KLEIN:
+        if (rowOut) {
+            *i = wrapIndex(*i, size);
+            *j = size - 1 - wrapIndex(*j, size);
+        } else {
+            *j = wrapIndex(*j, size);
+        }
+        return true;
+    case TOPOLOGY_CROSS: // Corners are singular points and stay dead
+        if (rowOut && columnOut) return false;
+        if (rowOut) {
+            *i = wrapIndex(*i, size);
+            *j = size - 1 - *j;
+        } else {
+            *j = wrapIndex(*j, size);
+            *i = size - 1 - *i;
+        }
+        return true;
+    case TOPOLOGY_SPHERE: { // Corners are singular points and stay dead
+        if (rowOut && columnOut) return false;
+        int row = *i, column = *j;
+        if (row < 0) { *i = column; *j = 0; }
+        else if (row >= size) { *i = column; *j = size - 1; }
+        else if (column < 0) { *i = 0; *j = row; }
+        else { *i = size - 1; *j = row; }
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+static void setHalo(bool** field, int size, topology kind, int i, int j) {
+    int row = i, column = j;
+    field[i][j] = haloSource(kind, size, &row, &column) && field[row][column];
+}
+
+void FillHalo(bool** field, int size, topology kind) { // 4 * size + 4 cells, negligible next to a step
+    for (int i = 0; i < size; i++) {
+        setHalo(field, size, kind, i, -1);
+        setHalo(field, size, kind, i, size);
+    }
+    for (int j = -1; j <= size; j++) {
+        setHalo(field, size, kind, -1, j);
+        setHalo(field, size, kind, size, j);
+    }
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include "stats.h"
+
+// Scoped spans go into a per-thread ring buffer and are dumped as Chrome trace JSON
+// (chrome://tracing or ui.perfetto.dev). Build with -DNO_TRACE to compile them out.
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+
+#ifndef NO_TRACE
+
+#define TRACE_THREADS 72
+#define TRACE_RING 65536 // Events kept per thread, oldest are overwritten
+
+typedef struct traceEvent {
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+} traceEvent;
+
+typedef struct traceRing {
+    traceEvent events[TRACE_RING];
+    _Atomic unsigned long long head;
+    char label[32];
+} traceRing;
+
+typedef struct traceSpan {
+    const char* name;
+    uint64_t start;
+} traceSpan;
+
+static traceRing* traceRings[TRACE_THREADS];
+static _Atomic int traceThreads = 0;
+static _Thread_local traceRing* traceLocal = NULL;
+static volatile sig_atomic_t traceRequested = 0;
+
+static void traceSignal(int signal) {
+    (void)signal;
+    traceRequested = 1;
+}
+
+void TraceOnSignal(void) { // SIGUSR1 asks for a dump, picked up by TraceRequested
+#ifdef SIGUSR1
+    signal(SIGUSR1, traceSignal);
+#endif
+}
+
+bool TraceRequested(void) {
+    if (!traceRequested) return false;
+    traceRequested = 0;
+    return true;
+}
+
+void TraceThread(const char* label) { // Names the calling thread's track, registering it on first use
+    if (traceLocal == NULL) {
+        int index = atomic_fetch_add(&traceThreads, 1);
+        if (index >= TRACE_THREADS) return;
+        traceLocal = (traceRing*)calloc(1, sizeof(traceRing));
+        traceRings[index] = traceLocal;
+    }
+    if (traceLocal != NULL) {
+        snprintf(traceLocal->label, sizeof(traceLocal->label), "%s", label);
+    }
+}
+
+traceSpan TraceBegin(const char* name) {
+    traceSpan span = {name, MonotonicNs()};
+    return span;
+}
+
+void TraceEnd(traceSpan* span) {
+    if (traceLocal == NULL) {
+        TraceThread("thread");
+        if (traceLocal == NULL) return;
+    }
+    unsigned long long head = atomic_load_explicit(&traceLocal->head, memory_order_relaxed);
+    traceEvent* event = &traceLocal->events[head % TRACE_RING];
+    event->name = span->name;
+    event->start = span->start;
+    event->duration = MonotonicNs() - span->start;
+    atomic_store_explicit(&traceLocal->head, head + 1, memory_order_release);
+}
+
+bool WriteTrace(const char* filename) { // Call while workers are idle, between steps
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) return false;
+
+    fprintf(file, "{\"traceEvents\":[\n");
+    bool first = true;
+    int threads = atomic_load(&traceThreads);
+    if (threads > TRACE_THREADS) threads = TRACE_THREADS;
+    for (int tid = 0; tid < threads; tid++) {
+        traceRing* ring = traceRings[tid];
+        if (ring == NULL) continue;
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", tid, ring->label);
+        first = false;
+
+        unsigned long long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned long long tail = head > TRACE_RING ? head - TRACE_RING : 0;
+        for (unsigned long long i = tail; i < head; i++) {
+            traceEvent* event = &ring->events[i % TRACE_RING];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    event->name, tid, (event->start - stats.startNs) / 1e3, event->duration / 1e3);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return true;
+}
+
+#define TRACE_SCOPE(name) \
+    traceSpan TRACE_CONCAT(traceSpan, __LINE__) __attribute__((cleanup(TraceEnd))) = TraceBegin(name)
+
+#else
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TraceThread(label) ((void)0)
+#define TraceOnSignal() ((void)0)
+#define TraceRequested() false
+#define WriteTrace(filename) false
+
+#endif
@@ -0,0 +1,184 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "frames.h"
+#include "rewind.h"
+#include "trace.h"
+
+// Undo and redo for edits. A mouse stroke is kept as the list of cells it toggled; bulk
+// edits (clearing, loading) pack the field beforehand and keep the tile delta between
+// that and the result, so the cost follows what changed rather than the field size.
+// Both kinds are XORs, so undoing and redoing an edit apply the same delta. The oldest
+// edits are dropped to stay inside the memory budget.
+
+typedef enum {
+    EDIT_CELLS,   // Toggled cells, row << 16 | column
+    EDIT_TILES,   // Tile delta, see rewind.h
+} editKind;
+
+typedef struct editEntry {
+    editKind kind;
+    void* data;
+    size_t length;                  // Cells or words
+    size_t capacity;                // Cells allocated, for strokes still growing
+    long long before, after;        // Population on either side of the edit
+} editEntry;
+
+typedef struct editHistory {
+    size_t budget;                  // Bytes, 0 disables undo
+    size_t used;
+    int size;
+    editEntry* entries;             // Oldest first
+    int count, capacity;
+    int applied;                    // Entries not undone; the rest can be redone
+    bool stroke;                    // The newest entry still takes toggles
+    uint64_t* packed;               // The field before the bulk edit in progress
+    tileDiff diff;
+} editHistory;
+
+void CreateEditHistory(editHistory* history, unsigned short size, size_t budget) {
+    memset(history, 0, sizeof(*history));
+    history->budget = budget;
+    history->size = size;
+    buildCellSpread();
+}
+
+static size_t editBytes(const editEntry* entry) {
+    return sizeof(editEntry) + (entry->kind == EDIT_CELLS ? entry->capacity * sizeof(uint32_t) : entry->length * sizeof(uint64_t));
+}
+
+static void dropEdits(editHistory* history, int from, int to) { // Entries [from, to)
+    for (int i = from; i < to; i++) {
+        history->used -= editBytes(&history->entries[i]);
+        free(history->entries[i].data);
+    }
+    memmove(history->entries + from, history->entries + to, (history->count - to) * sizeof(editEntry));
+    history->count -= to - from;
+    if (history->applied > from) history->applied = history->applied > to ? history->applied - (to - from) : from;
+}
+
+void ClearEditHistory(editHistory* history) { // The field stepped on, old edits no longer fit it
+    dropEdits(history, 0, history->count);
+    history->stroke = false;
+}
+
+void FreeEditHistory(editHistory* history) {
+    ClearEditHistory(history);
+    free(history->entries);
+    free(history->packed);
+    FreeTileDiff(&history->diff);
+    memset(history, 0, sizeof(*history));
+}
+
+static void trimEdits(editHistory* history) {
+    int drop = 0;
+    size_t used = history->used;
+    while (drop < history->count && used > history->budget) used -= editBytes(&history->entries[drop++]);
+    if (drop > 0) {
+        if (drop == history->count) history->stroke = false;
+        dropEdits(history, 0, drop);
+    }
+}
+
+static editEntry* pushEdit(editHistory* history, editKind kind, long long before) { // Drops whatever could be redone
+    dropEdits(history, history->applied, history->count);
+    if (history->count == history->capacity) {
+        int capacity = history->capacity ? history->capacity * 2 : 64;
+        editEntry* grown = (editEntry*)realloc(history->entries, capacity * sizeof(editEntry));
+        if (grown == NULL) return NULL;
+        history->entries = grown;
+        history->capacity = capacity;
+    }
+    editEntry* entry = &history->entries[history->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->kind = kind;
+    entry->before = entry->after = before;
+    history->applied = history->count;
+    history->used += editBytes(entry);
+    return entry;
+}
+
+void RecordToggle(editHistory* history, int row, int column, long long before, long long after) { // Joins the open stroke
+    if (history->budget == 0) return;
+    editEntry* entry = history->stroke && history->applied == history->count ? &history->entries[history->count - 1] : NULL;
+    if (entry == NULL && (entry = pushEdit(history, EDIT_CELLS, before)) == NULL) return;
+    history->stroke = true;
+    if (entry->length == entry->capacity) {
+        size_t capacity = entry->capacity ? entry->capacity * 2 : 16;
+        uint32_t* grown = (uint32_t*)realloc(entry->data, capacity * sizeof(uint32_t));
+        if (grown == NULL) return;
+        history->used += (capacity - entry->capacity) * sizeof(uint32_t);
+        entry->data = grown;
+        entry->capacity = capacity;
+    }
+    ((uint32_t*)entry->data)[entry->length++] = (uint32_t)row << 16 | (uint32_t)column;
+    entry->after = after;
+    trimEdits(history);
+}
+
+void EndStroke(editHistory* history) { // The next toggle starts a new edit
+    history->stroke = false;
+}
+
+void BeginBulkEdit(editHistory* history, bool** field) {
+    if (history->budget == 0) return;
+    history->stroke = false;
+    free(history->packed);
+    history->packed = (uint64_t*)malloc(((size_t)history->size + 63) / 64 * history->size * sizeof(uint64_t));
+    if (history->packed != NULL) PackField(field, history->size, history->packed);
+}
+
+void EndBulkEdit(editHistory* history, bool** field, long long before, long long after) { // Without the packed field the edit can't be undone
+    if (history->packed == NULL) return;
+    TRACE_SCOPE("EndBulkEdit");
+    uint64_t* data;
+    size_t words;
+    bool ok = DiffTiles(&history->diff, NULL, history->packed, field, history->size, &data, &words);
+    free(history->packed);
+    history->packed = NULL;
+    if (!ok || words == 0) {
+        free(data);
+        return;
+    }
+    editEntry* entry = pushEdit(history, EDIT_TILES, before);
+    if (entry == NULL) {
+        free(data);
+        return;
+    }
+    entry->data = data;
+    entry->length = words;
+    entry->after = after;
+    history->used += words * sizeof(uint64_t);
+    trimEdits(history);
+}
+
+static void applyEdit(const editHistory* history, const editEntry* entry, bool** field) {
+    if (entry->kind == EDIT_TILES) {
+        ApplyTiles((const uint64_t*)entry->data, entry->length, history->size, field);
+        return;
+    }
+    const uint32_t* cells = (const uint32_t*)entry->data;
+    for (size_t i = 0; i < entry->length; i++) {
+        bool* cell = &field[cells[i] >> 16][cells[i] & 0xffff];
+        *cell = !*cell;
+    }
+}
+
+bool UndoEdit(editHistory* history, bool** field, long long* population) { // False with nothing to undo
+    if (history->applied == 0) return false;
+    const editEntry* entry = &history->entries[--history->applied];
+    applyEdit(history, entry, field);
+    history->stroke = false;
+    *population = entry->before;
+    return true;
+}
+
+bool RedoEdit(editHistory* history, bool** field, long long* population) {
+    if (history->applied == history->count) return false;
+    const editEntry* entry = &history->entries[history->applied++];
+    applyEdit(history, entry, field);
+    *population = entry->after;
+    return true;
+}
@@ -0,0 +1,252 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "frames.h"
+#include "trace.h"
+
+// Video export. The workers pack each recorded generation into bits (as for the frame
+// stream) and hand it to a video thread, which downsamples it and writes it out while
+// the next generations are stepped. Each pixel covers scale x scale cells and is shaded
+// by how many of them are alive. Y4M is greyscale (flat chroma) for encoders that read it
+// directly; raw output is headerless rgb24 in the window's colours.
+
+#define VIDEO_MAX_SCALE 64
+
+typedef enum {
+    VIDEO_Y4M,
+    VIDEO_RGB,
+    VIDEO_FORMAT_COUNT,
+} videoFormat;
+
+const char* videoFormatNames[VIDEO_FORMAT_COUNT] = {"y4m", "rgb"};
+
+videoFormat ParseVideoFormat(const char* value) {
+    for (int i = 0; i < VIDEO_FORMAT_COUNT; i++) {
+        if (strcmp(value, videoFormatNames[i]) == 0) return (videoFormat)i;
+    }
+    return VIDEO_Y4M;
+}
+
+typedef struct videoStream {
+    FILE* file;
+    videoFormat format;
+    int size, scale, width, height;
+    size_t rowWords;
+    uint64_t* packed[2];     // The workers fill one while the video thread converts the other
+    int filling;             // Buffer the next generation is packed into
+    int pending;             // Buffer waiting for the video thread, -1 when none
+    unsigned char* frame;    // One output frame, Y4M's frame header and chroma included
+    size_t frameBytes;
+    size_t pixelOffset;
+    unsigned short* counts;  // Live cells under each pixel of a pixel row
+    unsigned char shade[VIDEO_MAX_SCALE * VIDEO_MAX_SCALE + 1][3]; // Pixel for each live count
+    unsigned char octets[256][24]; // Eight rgb pixels for each byte of cells, at one cell per pixel
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, taken;
+    bool quit, failed;
+} videoStream;
+
+static inline uint64_t bitsAt(const uint64_t* row, size_t rowWords, int start, int length) { // length (1..64) cells from start, 0 past the row
+    size_t word = (size_t)start >> 6;
+    int offset = start & 63;
+    if (word >= rowWords) return 0;
+    uint64_t bits = row[word] >> offset;
+    if (offset + length > 64 && word + 1 < rowWords) bits |= row[word + 1] << (64 - offset);
+    return length == 64 ? bits : bits & ((1ull << length) - 1);
+}
+
+static inline uint64_t fieldCounts(uint64_t bits, int scale) { // Live cells in each scale-bit field of a word, scale a power of two
+    if (scale >= 2) bits = bits - ((bits >> 1) & 0x5555555555555555ull);
+    if (scale >= 4) bits = (bits & 0x3333333333333333ull) + ((bits >> 2) & 0x3333333333333333ull);
+    if (scale >= 8) bits = (bits + (bits >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    if (scale >= 16) bits = (bits + (bits >> 8)) & 0x00ff00ff00ff00ffull;
+    if (scale >= 32) bits = (bits + (bits >> 16)) & 0x0000ffff0000ffffull;
+    if (scale >= 64) bits = (bits + (bits >> 32)) & 0xffffffffull;
+    return bits;
+}
+
+static inline void putPixel(unsigned char* out, const unsigned char* shade, int channels) {
+    out[0] = shade[0];
+    if (channels == 3) {
+        out[1] = shade[1];
+        out[2] = shade[2];
+    }
+}
+
+static void convertFrame(videoStream* stream, const uint64_t* packed) {
+    int channels = stream->format == VIDEO_RGB ? 3 : 1;
+    int scale = stream->scale;
+    for (int y = 0; y < stream->height; y++) {
+        unsigned char* out = stream->frame + stream->pixelOffset + (size_t)y * stream->width * channels;
+        if (scale == 1) {
+            const uint64_t* row = packed + stream->rowWords * y;
+            int x = 0;
+            if (channels == 1) { // Eight pixels per step: spread the bits to bytes and select between the two shades
+                uint64_t dead = 0x0101010101010101ull * stream->shade[0][0];
+                uint64_t live = 0x0101010101010101ull * stream->shade[1][0];
+                for (; x + 8 <= stream->width; x += 8) {
+                    uint64_t mask = cellSpread[(row[x >> 6] >> (x & 63)) & 0xff] * 0xff;
+                    uint64_t pixels = (live & mask) | (dead & ~mask);
+                    memcpy(out + x, &pixels, 8);
+                }
+            } else {
+                for (; x + 8 <= stream->width; x += 8) {
+                    memcpy(out + (size_t)x * 3, stream->octets[(row[x >> 6] >> (x & 63)) & 0xff], 24);
+                }
+            }
+            for (; x < stream->width; x++) {
+                putPixel(out + (size_t)x * channels, stream->shade[(row[x >> 6] >> (x & 63)) & 1], channels);
+            }
+            continue;
+        }
+
+        memset(stream->counts, 0, stream->width * sizeof(unsigned short));
+        int bottom = y * scale + scale < stream->size ? y * scale + scale : stream->size;
+        bool aligned = (scale & (scale - 1)) == 0; // Power-of-two pixels never straddle a word
+        int perWord = 64 / scale;
+        uint64_t mask = scale == 64 ? ~0ull : (1ull << scale) - 1;
+        for (int i = y * scale; i < bottom; i++) {
+            const uint64_t* row = packed + stream->rowWords * i;
+            if (!aligned) {
+                for (int x = 0; x < stream->width; x++) {
+                    stream->counts[x] += (unsigned short)__builtin_popcountll(bitsAt(row, stream->rowWords, x * scale, scale));
+                }
+                continue;
+            }
+            for (size_t w = 0; w < stream->rowWords; w++) { // A SWAR popcount per word leaves each pixel's count in its field
+                if (row[w] == 0) continue;
+                uint64_t counts = fieldCounts(row[w], scale);
+                int x = (int)w * perWord;
+                for (int k = 0; k < perWord && x + k < stream->width; k++) {
+                    stream->counts[x + k] += (unsigned short)((counts >> (k * scale)) & mask);
+                }
+            }
+        }
+        for (int x = 0; x < stream->width; x++) {
+            putPixel(out + (size_t)x * channels, stream->shade[stream->counts[x]], channels);
+        }
+    }
+}
+
+static void* videoMain(void* arg) {
+    videoStream* stream = (videoStream*)arg;
+    TraceThread("video");
+    pthread_mutex_lock(&stream->lock);
+    while (true) {
+        while (stream->pending < 0 && !stream->quit) pthread_cond_wait(&stream->wake, &stream->lock);
+        if (stream->pending < 0) break;
+        int buffer = stream->pending;
+        stream->pending = -1;
+        pthread_cond_signal(&stream->taken);
+        pthread_mutex_unlock(&stream->lock);
+
+        bool failed;
+        {
+            TRACE_SCOPE("videoFrame");
+            convertFrame(stream, stream->packed[buffer]);
+            failed = fwrite(stream->frame, 1, stream->frameBytes, stream->file) != stream->frameBytes;
+        }
+        pthread_mutex_lock(&stream->lock);
+        if (failed) stream->failed = true;
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+static void videoShades(videoStream* stream, const float live[3], const float dead[3]) {
+    int cells = stream->scale * stream->scale;
+    for (int count = 0; count <= cells; count++) {
+        float t = (float)count / cells;
+        float rgb[3];
+        for (int c = 0; c < 3; c++) {
+            rgb[c] = dead[c] + (live[c] - dead[c]) * t;
+            stream->shade[count][c] = (unsigned char)(rgb[c] * 255.0f + 0.5f);
+        }
+        if (stream->format == VIDEO_Y4M) { // Full-range (JPEG) luma
+            stream->shade[count][0] = (unsigned char)((0.299f * rgb[0] + 0.587f * rgb[1] + 0.114f * rgb[2]) * 255.0f + 0.5f);
+        }
+    }
+    for (int byte = 0; byte < 256; byte++) {
+        for (int k = 0; k < 8; k++) memcpy(stream->octets[byte] + k * 3, stream->shade[cells == 1 ? (byte >> k) & 1 : 0], 3);
+    }
+}
+
+bool OpenVideoStream(videoStream* stream, const char* target, videoFormat format, unsigned short size, int scale, int fps,
+                     const float live[3], const float dead[3]) { // "-" is stdout
+    memset(stream, 0, sizeof(*stream));
+    stream->file = OpenBinaryOutput(target);
+    if (stream->file == NULL) return false;
+
+    stream->format = format;
+    stream->size = size;
+    stream->scale = scale < 1 ? 1 : scale > VIDEO_MAX_SCALE ? VIDEO_MAX_SCALE : scale;
+    stream->width = stream->height = (size + stream->scale - 1) / stream->scale;
+    stream->rowWords = ((size_t)size + 63) / 64;
+    stream->pending = -1;
+    buildCellSpread();
+    videoShades(stream, live, dead);
+
+    size_t pixels = (size_t)stream->width * stream->height;
+    size_t chroma = (size_t)((stream->width + 1) / 2) * ((stream->height + 1) / 2);
+    stream->pixelOffset = format == VIDEO_Y4M ? strlen("FRAME\n") : 0;
+    stream->frameBytes = format == VIDEO_Y4M ? stream->pixelOffset + pixels + 2 * chroma : pixels * 3;
+    stream->frame = (unsigned char*)malloc(stream->frameBytes);
+    stream->counts = (unsigned short*)malloc(stream->width * sizeof(unsigned short));
+    stream->packed[0] = (uint64_t*)malloc(stream->rowWords * size * sizeof(uint64_t));
+    stream->packed[1] = (uint64_t*)malloc(stream->rowWords * size * sizeof(uint64_t));
+    bool ok = stream->frame != NULL && stream->counts != NULL && stream->packed[0] != NULL && stream->packed[1] != NULL;
+
+    if (ok && format == VIDEO_Y4M) {
+        memcpy(stream->frame, "FRAME\n", stream->pixelOffset);
+        memset(stream->frame + stream->pixelOffset + pixels, 128, 2 * chroma);
+        ok = fprintf(stream->file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", stream->width, stream->height, fps) > 0;
+    }
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->wake, NULL);
+    pthread_cond_init(&stream->taken, NULL);
+    if (!ok || pthread_create(&stream->thread, NULL, videoMain, stream) != 0) { // Closing skips the join without a file
+        fclose(stream->file);
+        stream->file = NULL;
+        return false;
+    }
+    printf("Video: %s, %dx%d, %d cells per pixel\n", target, stream->width, stream->height, stream->scale);
+    return true;
+}
+
+bool SubmitVideoFrame(videoStream* stream, bool** field) { // Waits only while the video thread is a frame behind; false once output fails
+    TRACE_SCOPE("SubmitVideoFrame");
+    pthread_mutex_lock(&stream->lock);
+    while (stream->pending >= 0) pthread_cond_wait(&stream->taken, &stream->lock);
+    bool failed = stream->failed;
+    pthread_mutex_unlock(&stream->lock);
+    if (failed) return false;
+
+    PackField(field, stream->size, stream->packed[stream->filling]);
+    pthread_mutex_lock(&stream->lock);
+    stream->pending = stream->filling;
+    pthread_cond_signal(&stream->wake);
+    pthread_mutex_unlock(&stream->lock);
+    stream->filling ^= 1;
+    return true;
+}
+
+void CloseVideoStream(videoStream* stream) { // Writes the frame still pending
+    if (stream->file != NULL) {
+        pthread_mutex_lock(&stream->lock);
+        stream->quit = true;
+        pthread_cond_signal(&stream->wake);
+        pthread_mutex_unlock(&stream->lock);
+        pthread_join(stream->thread, NULL);
+        fclose(stream->file);
+    }
+    free(stream->frame);
+    free(stream->counts);
+    free(stream->packed[0]);
+    free(stream->packed[1]);
+    memset(stream, 0, sizeof(*stream));
+}
@@ -1,12 +1,29 @@
+#define _GNU_SOURCE
 #include "include/GLFW/glfw3.h"
 #include "include/logic.h"
 #include "include/json.h"
+#include "include/stats.h"
+#include "include/metrics.h"
+#include "include/cycle.h"
+#include "include/rle.h"
+#include "include/macrocell.h"
+#include "include/frames.h"
+#include "include/video.h"
+#include "include/rewind.h"
+#include "include/undo.h"
+#include "include/census.h"
+#include "include/label.h"
+#include "include/random.h"
+#include "include/ensemble.h"
+#include "include/shard.h"
 
 #define SIZE 700
 #define MAX_KEYS 1024
+#define REWIND_JUMP 100 // Generations Shift+Left goes back
+#define MAX_LABEL_BOXES 20000 // Highlighted objects drawn per frame
 
 bool** CreateField(const unsigned short size);
-void NextStep(bool** current, bool** next, const unsigned short size);
+stepResult NextStep(bool** current, bool** next, const unsigned short size);
 char* ReadJson(const char* filename);
 returnPair ParseJson(char* data);
 void FreeField(bool** field, unsigned short size);
@@ -27,6 +44,44 @@ static void setWindowIcon(GLFWwindow* window, const char* iconPath) {
 //global variables declaration
 unsigned short fieldSize = 40; // Default field size
 float stepDelay = 0.05f; // Default step delay in seconds
+int threadCount = 0; // Default worker count, 0 uses every core
+bool headless = false; // Run without a window
+unsigned long long generationLimit = 0; // Headless generations to run, 0 runs until killed
+unsigned long long statsEvery = 0; // Headless stats dump interval in generations
+char statsFile[JSON_WORD] = "stats.json";
+char patternFile[JSON_WORD] = ""; // RLE pattern loaded at startup instead of the glider
+char exportFile[JSON_WORD] = "export.rle";
+char metricsAddress[JSON_WORD] = ""; // Metrics endpoint, empty to disable
+char traceFile[JSON_WORD] = "trace.json";
+char framesTarget[JSON_WORD] = ""; // Headless frame stream, a path or "-" for stdout, empty to disable
+unsigned long long frameEvery = 1; // Generations between streamed frames
+unsigned long long frameKeyEvery = 256; // Frames between keyframes, 1 sends keyframes only
+char videoTarget[JSON_WORD] = ""; // Video export, a path or "-" for stdout, empty to disable
+videoFormat videoOutput = VIDEO_Y4M;
+unsigned long long videoEvery = 1; // Generations between video frames
+int videoScale = 1; // Cells per pixel side
+int videoFps = 30;
+bool cycleDetect = true; // Pause, or stop headless runs, once the field repeats
+int cycleHistory = 4096; // Generations remembered for cycle detection
+unsigned long long rewindMemory = 64; // Rewind log budget in MB, 0 disables
+unsigned long long undoMemory = 64; // Edit history budget in MB, 0 disables
+char censusFile[JSON_WORD] = ""; // Soup census output, set to run a census instead of the simulation
+unsigned long long soupCount = 10000;
+int soupSize = 16; // Side of each random soup
+int censusField = 96; // Side of the field each soup runs in
+unsigned long long censusSeed = 1;
+unsigned long long soupGenerations = 20000; // Soups not repeating by then are counted as unsettled
+char ensembleFile[JSON_WORD] = ""; // Ensemble results, set to run an ensemble instead of the simulation
+char ensembleRules[JSON_WORD] = ""; // Rules separated by ';', or @file with one per line; empty runs the active rule
+int universeCount = 256;
+int ensembleSize = 64; // Side of each universe
+unsigned long long ensembleGenerations = 1000; // Universes not repeating by then stop anyway
+bool bitSliced = true; // Ensembles step 64 universes of a rule at once when every rule allows it
+int labelGap = 1; // Cells highlighted as one object may be this far apart, 1 joins touching cells
+double fillDensity = 0.5; // Share of cells a random fill sets alive
+unsigned long long fillSeed = 1; // Seed of the next random fill, each fill moves it on
+bool fillStart = false; // Start from a random fill instead of the glider
+int shardCount = 0; // Processes a headless run splits the field between, 0 or 1 runs in this one
 
 bool **field = NULL;
 bool **newField = NULL;
@@ -35,19 +90,36 @@ bool **savedField = NULL;
 const float margin = 0.05f;
 const float gridSize = SIZE * (1 - 2 * margin);
 const float startXY = (SIZE - gridSize) / 2;
+const float backgroundColor[3] = {0.1f, 0.1f, 0.15f};
 float cellSize;
 
+cycleDetector cycles;
+frameStream frameOut;
+videoStream video;
+rewindLog history;
+editHistory edits;
+bool cyclesDirty = true; // Field was edited since the last step
+labeller labels;
+uint64_t* labelPacked = NULL;
+bool showLabels = false;
+bool labelsStale = true; // Field changed since it was last labelled
+
 double lastStepTime = 0.0;
+double lastTitleTime = 0.0;
 bool shouldWait = true;
 
 short lastCellI = -1;
 short lastCellJ = -1;
+short fillAnchorI = -1; // Corners of the region being selected with the right button
+short fillAnchorJ = -1;
+short fillCornerI = -1;
+short fillCornerJ = -1;
 
 bool keyStates[MAX_KEYS] = {false};
 
-static void drawRectangle(float x1, float y1, float x2, float y2, float x3, float y3, float x4, float y4) {
+static void drawRectangle(float x1, float y1, float x2, float y2, float x3, float y3, float x4, float y4, const float* color) {
     glBegin(GL_QUADS);
-    glColor3f(0.7f, 0.7f, 0.7f);
+    glColor3f(color[0], color[1], color[2]);
     glVertex2f(x1, y1);
     glVertex2f(x2, y2);
     glVertex2f(x3, y3);
@@ -55,6 +127,27 @@ static void drawRectangle(float x1, float y1, float x2, float y2, float x3, floa
     glEnd();
 }
 
+static void drawHexagon(float x, float y, float width, float height, const float* color) { // Pointy-top hexagon filling the box at x, y
+    float quarter = height / 4;
+    glBegin(GL_POLYGON);
+    glColor3f(color[0], color[1], color[2]);
+    glVertex2f(x + width / 2, y);
+    glVertex2f(x + width, y + quarter);
+    glVertex2f(x + width, y + height - quarter);
+    glVertex2f(x + width / 2, y + height);
+    glVertex2f(x, y + height - quarter);
+    glVertex2f(x, y + quarter);
+    glEnd();
+}
+
+static bool hexGrid(void) {
+    return activeRule.neighbourhood == NEIGHBOURHOOD_HEX;
+}
+
+static float cellWidth(void) { // Hex rows are offset by half a cell, so each row holds size + 1/2 cells
+    return hexGrid() ? gridSize / (fieldSize + 0.5f) : cellSize;
+}
+
 static void drawGrid() {
     glColor3f(0.7f, 0.7f, 0.7f);
     glLineWidth(1.0f);
@@ -64,24 +157,51 @@ static void drawGrid() {
     for (unsigned short i = 0; i <= fieldSize; i++) {
         float x = startXY + i * cellSize;
         float y = x;
-        glVertex2f(x, startXY);
-        glVertex2f(x, startXY + gridSize);
+        if (!hexGrid()) { // Hex cells only share row lines
+            glVertex2f(x, startXY);
+            glVertex2f(x, startXY + gridSize);
+        }
         glVertex2f(startXY, y);
         glVertex2f(startXY + gridSize, y);
     }
     glEnd();
 }
 
+static void cellColor(unsigned state, float* color) { // Live cells grey, dying states fade from orange to dark red
+    if (state <= 1) {
+        color[0] = color[1] = color[2] = 0.7f;
+        return;
+    }
+    float t = activeRule.states > 3 ? (float)(state - 2) / (activeRule.states - 3) : 0.0f;
+    color[0] = 0.9f - 0.55f * t;
+    color[1] = 0.55f - 0.4f * t;
+    color[2] = 0.2f - 0.05f * t;
+}
+
 static void fillField(bool** field, unsigned short size) {
+    bool multiState = activeRule.states > 2 && generations.valid;
+    float palette[MAX_STATES][3];
+    for (unsigned state = 0; state < MAX_STATES; state++) {
+        cellColor(state, palette[state]);
+    }
+
+    bool hex = hexGrid();
+    float width = cellWidth();
     for(unsigned short i = 0; i < size; i++) {
+        float shift = hex && (i & 1) ? width / 2 : 0;
         for (unsigned short j = 0; j < size; j++) {
-            if (field[i][j]) {
-                float x = startXY + j * cellSize;
+            unsigned state = multiState ? CellState(i, j) : field[i][j];
+            if (state) {
+                float x = startXY + shift + j * width;
                 float y = startXY + (size - 1 - i) * cellSize;
-                drawRectangle(x, y, 
-                            x + cellSize, y, 
-                            x + cellSize, y + cellSize, 
-                            x, y + cellSize);
+                if (hex) {
+                    drawHexagon(x, y, width, cellSize, palette[state]);
+                } else {
+                    drawRectangle(x, y, 
+                                x + cellSize, y, 
+                                x + cellSize, y + cellSize, 
+                                x, y + cellSize, palette[state]);
+                }
             }
         }
     }
@@ -93,8 +213,221 @@ static void swapFields(bool ***current, bool ***next, unsigned short size) {
     *next = temp;
 }
 
+static void recordVideo(void) {
+    if (video.file == NULL || STAT_GET(generation) % videoEvery != 0) return;
+    if (!SubmitVideoFrame(&video, field)) {
+        fprintf(stderr, "Error: video output %s closed\n", videoTarget);
+        CloseVideoStream(&video);
+    }
+}
+
+static bool relabelField(void) {
+    if (!labelsStale) return true;
+    TRACE_SCOPE("relabelField");
+    if (labelPacked == NULL) labelPacked = (uint64_t*)malloc(((size_t)fieldSize + 63) / 64 * fieldSize * sizeof(uint64_t));
+    if (labelPacked == NULL) return false;
+    PackField(field, fieldSize, labelPacked);
+    if (LabelPacked(&labels, labelPacked, fieldSize, labelGap, activeTopology == TOPOLOGY_TORUS, true) < 0) return false; // The labeller only joins edges untwisted
+    labelsStale = false;
+    return true;
+}
+
+static void drawLabels(void) { // Bounding boxes of the objects; boxes across the torus edge stick out of the grid
+    if (!showLabels || !relabelField()) return;
+    float width = cellWidth();
+    glColor3f(0.3f, 0.8f, 1.0f);
+    glLineWidth(1.0f);
+    for (int c = 0; c < labels.componentCount && c < MAX_LABEL_BOXES; c++) {
+        const component* object = &labels.components[c];
+        float x1 = startXY + object->left * width, x2 = x1 + object->width * width;
+        float y1 = startXY + (fieldSize - object->top - object->height) * cellSize, y2 = y1 + object->height * cellSize;
+        glBegin(GL_LINE_LOOP);
+        glVertex2f(x1, y1);
+        glVertex2f(x2, y1);
+        glVertex2f(x2, y2);
+        glVertex2f(x1, y2);
+        glEnd();
+    }
+}
+
+static void printLabels(void) {
+    if (!relabelField()) {
+        fprintf(stderr, "Error: out of memory labelling the field\n");
+        return;
+    }
+    long long largest = 0;
+    for (int c = 0; c < labels.componentCount; c++) {
+        if (labels.components[c].population > largest) largest = labels.components[c].population;
+    }
+    printf("Labels: %d objects, largest %lld cells\n", labels.componentCount, largest);
+}
+
+static void drawSelection(void) { // The region a right drag fills
+    if (fillAnchorI < 0) return;
+    float width = cellWidth();
+    int top = fillAnchorI < fillCornerI ? fillAnchorI : fillCornerI, bottom = fillAnchorI < fillCornerI ? fillCornerI : fillAnchorI;
+    int left = fillAnchorJ < fillCornerJ ? fillAnchorJ : fillCornerJ, right = fillAnchorJ < fillCornerJ ? fillCornerJ : fillAnchorJ;
+    float x1 = startXY + left * width, x2 = startXY + (right + 1) * width;
+    float y1 = startXY + (fieldSize - 1 - bottom) * cellSize, y2 = startXY + (fieldSize - top) * cellSize;
+    glColor3f(0.9f, 0.75f, 0.3f);
+    glLineWidth(1.0f);
+    glBegin(GL_LINE_LOOP);
+    glVertex2f(x1, y1);
+    glVertex2f(x2, y1);
+    glVertex2f(x2, y2);
+    glVertex2f(x1, y2);
+    glEnd();
+}
+
+static void reportHistory(void) {
+    STAT_SET(historyBytes, history.used + edits.used);
+}
+
+static void fieldEdited(void) { // Cycle detection starts over and history no longer leads here
+    cyclesDirty = true;
+    labelsStale = true;
+    ClearRewindLog(&history);
+    reportHistory();
+}
+
+static void randomFill(int top, int left, int height, int width) {
+    TRACE_SCOPE("randomFill");
+    long long population = STAT_GET(population);
+    BeginBulkEdit(&edits, field);
+    long long change = FillRandom(field, top, left, height, width, fillDensity, fillSeed);
+    EndBulkEdit(&edits, field, population, population + change);
+    STAT_SET(population, population + change);
+    InvalidateStates();
+    fieldEdited();
+    printf("Fill: %dx%d at %d,%d, density %.3g, seed %llu\n", width, height, left, top, fillDensity, fillSeed);
+    fillSeed++;
+}
+
+static void undoField(bool redo) {
+    long long population;
+    if (!(redo ? RedoEdit(&edits, field, &population) : UndoEdit(&edits, field, &population))) return;
+    STAT_SET(population, population);
+    InvalidateStates();
+    fieldEdited();
+    shouldWait = true;
+    printf("%s: %d of %d edits applied, %.1f KB history\n", redo ? "Redo" : "Undo", edits.applied, edits.count, edits.used / 1024.0);
+}
+
+static void rewindField(unsigned long long steps) { // Goes back up to steps generations
+    unsigned long long generation = STAT_GET(generation);
+    unsigned long long oldest = RewindOldest(&history, generation);
+    unsigned long long target = generation - oldest > steps ? generation - steps : oldest;
+    long long population;
+    if (!RewindTo(&history, field, generation, target, &population)) return;
+    STAT_SET(generation, target);
+    STAT_SET(population, population);
+    InvalidateStates();
+    cyclesDirty = true;
+    labelsStale = true;
+    shouldWait = true;
+}
+
+static bool stepField(void) { // Returns true when the field starts repeating
+    if (cycleDetect && cyclesDirty) {
+        ResetCycleDetector(&cycles);
+        STAT_SET(cyclePeriod, 0);
+        ObserveGeneration(&cycles, STAT_GET(generation), HashField(field, fieldSize));
+        cyclesDirty = false;
+    }
+
+    TRACE_SCOPE("NextStep");
+    unsigned long long generation = STAT_GET(generation);
+    long long population = STAT_GET(population);
+    uint64_t start = MonotonicNs();
+    stepResult result = NextStep(field, newField, fieldSize);
+    swapFields(&field, &newField, fieldSize);
+    labelsStale = true;
+    RecordStep(MonotonicNs() - start, result.population);
+    RecordRewind(&history, newField, field, generation, population);
+    if (edits.count > 0) ClearEditHistory(&edits);
+    reportHistory();
+    recordVideo();
+
+    if (cycleDetect && ObserveGeneration(&cycles, STAT_GET(generation), result.hash)) {
+        STAT_SET(cyclePeriod, cycles.period);
+        STAT_SET(cycleSince, cycles.since);
+        printf("Cycle: generation %llu repeats generation %llu, period %llu\n",
+               STAT_GET(generation), cycles.since, cycles.period);
+        return true;
+    }
+    return false;
+}
+
+static void dumpStats(void) {
+    size_t newPerNode[MAX_NODES];
+    stats.nodes = FieldPerNode(field, stats.nodeBytes);
+    if (stats.nodes > 0 && FieldPerNode(newField, newPerNode) == stats.nodes) {
+        for (int node = 0; node < stats.nodes; node++) {
+            stats.nodeBytes[node] += newPerNode[node];
+        }
+    }
+    if (!WriteStats(statsFile)) {
+        fprintf(stderr, "Error: cannot write %s\n", statsFile);
+    }
+}
+
+static void dumpTrace(void) {
+#ifdef NO_TRACE
+    fprintf(stderr, "Error: tracing was compiled out (NO_TRACE)\n");
+#else
+    if (!WriteTrace(traceFile)) {
+        fprintf(stderr, "Error: cannot write %s\n", traceFile);
+    }
+#endif
+}
+
+static void updateTitle(GLFWwindow* window) {
+    char title[256];
+    int length = snprintf(title, sizeof(title), "Game of Life | %s | %s | %s | ", activeRule.name,
+                          topologyNames[activeTopology], engineNames[activeEngine]);
+    FormatStatsLine(title + length, sizeof(title) - length);
+    glfwSetWindowTitle(window, title);
+}
+
+static void printNodeUsage(void) {
+    size_t perNode[MAX_NODES] = {0};
+    size_t newPerNode[MAX_NODES];
+    int nodes = FieldPerNode(field, perNode);
+    if (nodes == 0 || FieldPerNode(newField, newPerNode) != nodes) return;
+
+    printf("Field memory: %.1f MB mapped, %d workers", (size_t)pagesInUse / 1048576.0, pool.count);
+    for (int node = 0; node < nodes; node++) {
+        printf(", node%d %.1f MB", node, (perNode[node] + newPerNode[node]) / 1048576.0);
+    }
+    printf("\n");
+}
+
+#define SLOT_MAGIC "GOLS"
+#define SLOT_HEADER 256
+
 static void writeFieldToFile(bool** field, unsigned short size, const char* filename) {
     FILE *file = fopen(filename, "wb");
+    if (file == NULL) return;
+
+    bool nibbles = activeRule.states > 2 && generations.valid;
+    char header[SLOT_HEADER]; // key=value lines between the magic and the cells
+    unsigned short length = (unsigned short)snprintf(header, sizeof(header), "rule=%s\ntopology=%s\n",
+                                                     activeRule.name, topologyNames[activeTopology]);
+    if (nibbles) {
+        length += (unsigned short)snprintf(header + length, sizeof(header) - length, "size=%hu\nformat=nibbles\n", size);
+    }
+    fwrite(SLOT_MAGIC, 1, 4, file);
+    fwrite(&length, sizeof(length), 1, file);
+    fwrite(header, 1, length, file);
+
+    if (nibbles) { // Multi-state fields are stored as their packed state rows
+        for (unsigned short row = 0; row < size; row++) {
+            fwrite(StateRow(row), 1, (size + 1) / 2, file);
+        }
+        fclose(file);
+        return;
+    }
+
     for (unsigned short row = 0; row < size; row++) {
         for (unsigned short col = 0; col < size; col++) {
             if (field[row][col]) {
@@ -106,11 +439,77 @@ static void writeFieldToFile(bool** field, unsigned short size, const char* file
     fclose(file);
 }
 
+typedef struct slotHeader {
+    bool nibbles;
+    unsigned short size;
+} slotHeader;
+
+static slotHeader readSlotHeader(char* header) {
+    slotHeader slot = {false, 0};
+    for (char* line = strtok(header, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        char* equals = strchr(line, '=');
+        if (equals == NULL) continue;
+        *equals = '\0';
+        if (strcmp(line, "rule") == 0 && ParseRule(equals + 1, &activeRule)) {
+            printf("Rule: %s\n", activeRule.name);
+        }
+        else if (strcmp(line, "topology") == 0 && ParseTopology(equals + 1, &activeTopology)) {
+            printf("Topology: %s\n", topologyNames[activeTopology]);
+        }
+        else if (strcmp(line, "size") == 0) {
+            slot.size = (unsigned short)atoi(equals + 1);
+        }
+        else if (strcmp(line, "format") == 0) {
+            slot.nibbles = strcmp(equals + 1, "nibbles") == 0;
+        }
+    }
+    return slot;
+}
+
+static void readStateRows(bool** field, unsigned short size, FILE* file, unsigned short fileSize) {
+    unsigned char* packed = (unsigned char*)malloc((fileSize + 1) / 2);
+    SyncStates(field, size);
+    for (unsigned short row = 0; row < fileSize && fread(packed, 1, (fileSize + 1) / 2, file) == (size_t)(fileSize + 1) / 2; row++) {
+        if (row >= size) break;
+        for (unsigned short col = 0; col < fileSize && col < size; col++) {
+            unsigned state = (packed[col / 2] >> ((col & 1) * 4)) & 15;
+            if (state >= activeRule.states) state = 0;
+            SetCellState(row, col, state);
+            field[row][col] = state == 1;
+        }
+    }
+    free(packed);
+}
+
 static void readFieldFromFile(bool** field, unsigned short size, const char* filename) {
     FILE *file = fopen(filename, "rb");
+    if (file == NULL) return;
+
+    char magic[4];
+    unsigned short length;
+    if (fread(magic, 1, 4, file) == 4 && memcmp(magic, SLOT_MAGIC, 4) == 0 && fread(&length, sizeof(length), 1, file) == 1) {
+        char header[SLOT_HEADER];
+        if (length >= SLOT_HEADER || fread(header, 1, length, file) != length) {
+            fclose(file);
+            return;
+        }
+        header[length] = '\0';
+        slotHeader slot = readSlotHeader(header);
+        if (slot.nibbles) {
+            readStateRows(field, size, file, slot.size);
+            fclose(file);
+            return;
+        }
+    }
+    else {
+        rewind(file); // Slots written before the header are bare coordinates
+    }
+
     unsigned short coords[2];
     while (fread(coords, sizeof(unsigned short), 2, file) == 2) {
-        field[coords[0]][coords[1]] = true;
+        if (coords[0] < size && coords[1] < size) {
+            field[coords[0]][coords[1]] = true;
+        }
     }
     fclose(file);
 }
@@ -170,11 +569,16 @@ static void KeyPressed(GLFWwindow* window, int key, int scancode, int action, in
     
     if (key == GLFW_KEY_C && action == GLFW_PRESS){ // For clearing the field
         shouldWait = true;
+        BeginBulkEdit(&edits, field);
         for (unsigned short i = 0; i < fieldSize; i++) {
             for (unsigned short j = 0; j < fieldSize; j++) {
                 field[i][j] = 0;
             }
         }
+        EndBulkEdit(&edits, field, STAT_GET(population), 0);
+        STAT_SET(population, 0);
+        InvalidateStates();
+        fieldEdited();
     }
 
     if (key == GLFW_KEY_S && action == GLFW_PRESS){ // For saving the field
@@ -188,11 +592,13 @@ static void KeyPressed(GLFWwindow* window, int key, int scancode, int action, in
                 savedField[i][j] = field[i][j];
             }
         }
+        MarkCheckpoint();
     }
 
     if (key == GLFW_KEY_P && action == GLFW_PRESS){ // For loading the saved field
         if (savedField != NULL) {
             shouldWait = true;
+            BeginBulkEdit(&edits, field);
             FreeField(field, fieldSize);
             field = CreateField(fieldSize);
             for (unsigned short i = 0; i < fieldSize; i++) {
@@ -200,9 +606,56 @@ static void KeyPressed(GLFWwindow* window, int key, int scancode, int action, in
                     field[i][j] = savedField[i][j];
                 }
             }
+            EndBulkEdit(&edits, field, STAT_GET(population), CountField(field, fieldSize));
+            STAT_SET(population, CountField(field, fieldSize));
+            InvalidateStates();
+            fieldEdited();
+        }
+    }
+
+    if (key == GLFW_KEY_I && action == GLFW_PRESS){ // For dumping stats
+        dumpStats();
+    }
+
+    if (key == GLFW_KEY_T && action == GLFW_PRESS){ // For dumping the trace
+        dumpTrace();
+    }
+
+    if (key == GLFW_KEY_X && action == GLFW_PRESS){ // For exporting the field as RLE or plaintext
+        TRACE_SCOPE("exportPattern");
+        if (ExportPattern(exportFile, field, fieldSize)) {
+            printf("Exported %s\n", exportFile);
+        } else {
+            fprintf(stderr, "Error: cannot write %s\n", exportFile);
         }
     }
 
+    if (key == GLFW_KEY_LEFT && action != GLFW_RELEASE){ // For stepping back, held down it scrubs
+        rewindField(mods & GLFW_MOD_SHIFT ? REWIND_JUMP : 1);
+    }
+
+    if (key == GLFW_KEY_Z && action != GLFW_RELEASE && (mods & GLFW_MOD_CONTROL)){ // For undoing edits, with shift redoing them
+        undoField(mods & GLFW_MOD_SHIFT);
+    }
+
+    if (key == GLFW_KEY_Y && action != GLFW_RELEASE && (mods & GLFW_MOD_CONTROL)){ // For redoing edits
+        undoField(true);
+    }
+
+    if (key == GLFW_KEY_F && action == GLFW_PRESS){ // For filling the field with a random soup
+        shouldWait = true;
+        randomFill(0, 0, fieldSize, fieldSize);
+    }
+
+    if (key == GLFW_KEY_L && action == GLFW_PRESS){ // For highlighting objects
+        showLabels = !showLabels;
+        if (showLabels) printLabels();
+    }
+
+    if (key == GLFW_KEY_E && action == GLFW_PRESS){ // For switching the step engine
+        activeEngine = (stepEngine)((activeEngine + 1) % ENGINE_COUNT);
+    }
+
     if (key >= 0 && key < MAX_KEYS) { // Update key states
         if (action == GLFW_PRESS) {
             keyStates[key] = true;
@@ -217,6 +670,7 @@ static void KeyPressed(GLFWwindow* window, int key, int scancode, int action, in
         if (bothPressed && !comboTriggered[i]) {
             shouldWait = true;
             writeFieldToFile(field, fieldSize, combosW[i].filename);
+            MarkCheckpoint();
             comboTriggered[i] = true;
         }
         else if (!bothPressed) {
@@ -228,9 +682,14 @@ static void KeyPressed(GLFWwindow* window, int key, int scancode, int action, in
         bool bothPressed = keyStates[combosR[i].key1] && keyStates[combosR[i].key2];
         if (bothPressed && !comboTriggered[i]) {
             shouldWait = true;
+            BeginBulkEdit(&edits, field);
             FreeField(field, fieldSize);
             field = CreateField(fieldSize);
+            InvalidateStates();
             readFieldFromFile(field, fieldSize, combosR[i].filename);
+            EndBulkEdit(&edits, field, STAT_GET(population), CountField(field, fieldSize));
+            STAT_SET(population, CountField(field, fieldSize));
+            fieldEdited();
             comboTriggered[i] = true;
         }
         else if (!bothPressed) {
@@ -249,16 +708,28 @@ static void KeyPressed(GLFWwindow* window, int key, int scancode, int action, in
     }
 }
 
+static bool cellAt(GLFWwindow* window, unsigned short* i, unsigned short* j) { // The cell under the cursor, false off the grid
+    double xpos, ypos;
+    glfwGetCursorPos(window, &xpos, &ypos);
+    if (!(xpos > startXY && xpos < SIZE - startXY && ypos > startXY && ypos < SIZE - startXY)) return false;
+    *i = (ypos - startXY) / cellSize;
+    double shift = hexGrid() && (*i & 1) ? cellWidth() / 2 : 0; // Odd hex rows sit half a cell right
+    if (xpos - startXY < shift) return false;
+    *j = (xpos - startXY - shift) / cellWidth();
+    return *i < fieldSize && *j < fieldSize;
+}
+
 static void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
     if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS) {
-        double xpos, ypos;
-        glfwGetCursorPos(window, &xpos, &ypos);
-        
-        if (xpos > startXY && xpos < SIZE - startXY && ypos > startXY && ypos < SIZE - startXY) {
-            unsigned short i = (ypos - startXY) / cellSize;
-            unsigned short j = (xpos - startXY) / cellSize;
+        unsigned short i, j;
+        if (cellAt(window, &i, &j)) {
             if (lastCellI != i || lastCellJ != j) {
+                long long population = STAT_GET(population);
                 field[i][j] = !field[i][j]; //change cell status
+                STAT_ADD(population, field[i][j] ? 1 : -1);
+                RecordToggle(&edits, i, j, population, STAT_GET(population));
+                SetCellState(i, j, field[i][j]);
+                fieldEdited();
                 lastCellI = i;
                 lastCellJ = j;
             }
@@ -266,21 +737,334 @@ static void mouseButtonCallback(GLFWwindow* window, int button, int action, int
     }
 }
 
-int main(void) {
+static bool loadPattern(const char* filename) {
+    TRACE_SCOPE("loadPattern");
+    if (!ReadPattern(filename, field, fieldSize)) {
+        fprintf(stderr, "Error: cannot read pattern %s\n", filename);
+        return false;
+    }
+    STAT_SET(population, CountField(field, fieldSize));
+    InvalidateStates();
+    fieldEdited();
+    return true;
+}
+
+static void dropCallback(GLFWwindow* window, int count, const char** paths) { // Dropping an .rle or .mc file loads it
+    if (count == 0) return;
+    long long population = STAT_GET(population);
+    BeginBulkEdit(&edits, field);
+    bool loaded = loadPattern(paths[count - 1]);
+    EndBulkEdit(&edits, field, population, STAT_GET(population));
+    if (loaded) {
+        shouldWait = true;
+    }
+}
+
+static bool streamFrame(void) { // False once the frame reader is gone
+    if (frameOut.file == NULL || STAT_GET(generation) % frameEvery != 0) return true;
+    if (WriteFrame(&frameOut, field, STAT_GET(generation), STAT_GET(population))) return true;
+    fprintf(stderr, "Error: frame stream %s closed\n", framesTarget);
+    return false;
+}
+
+static bool startCensus(void) {
+    censusConfig config = {soupCount, censusSeed, soupGenerations, soupSize, censusField, cycleHistory};
+    bool ok = RunCensus(&config, censusFile);
+    if (ok) printf("Census: wrote %s\n", censusFile);
+    return ok;
+}
+
+static bool startEnsemble(void) { // Universes take their seeds and density from the random fill settings
+    rule* rules = NULL;
+    int count = 1;
+    if (ensembleRules[0] == '@') {
+        char* text = ReadJson(ensembleRules + 1);
+        if (text == NULL) {
+            fprintf(stderr, "Error: cannot read %s\n", ensembleRules + 1);
+            return false;
+        }
+        count = ParseRules(text, &rules);
+        free(text);
+    } else if (ensembleRules[0] != '\0') {
+        count = ParseRules(ensembleRules, &rules);
+    }
+    if (count < 1) {
+        fprintf(stderr, "Error: no rules for the ensemble\n");
+        free(rules);
+        return false;
+    }
+    ensembleConfig config = {universeCount, ensembleSize, cycleHistory, ensembleGenerations, fillSeed, fillDensity, rules != NULL ? rules : &activeRule, count, bitSliced};
+    bool ok = RunEnsemble(&config, ensembleFile);
+    if (ok) printf("Ensemble: wrote %s\n", ensembleFile);
+    free(rules);
+    return ok;
+}
+
+static bool startShards(void) { // Shards start from the random fill settings or the glider
+    if (patternFile[0] != '\0') {
+        fprintf(stderr, "Error: sharded runs cannot load %s, starting from %s\n", patternFile, fillStart ? "a random fill" : "the glider");
+    }
+    shardConfig config = {shardCount, threadCount, fieldSize, &activeRule, activeTopology, generationLimit,
+                          cycleDetect ? cycleHistory : 0, statsEvery, fillStart, fillDensity, fillSeed};
+    return RunShards(&config);
+}
+
+static int runHeadless(void) {
+    bool streaming = streamFrame();
+    while (streaming && (generationLimit == 0 || STAT_GET(generation) < generationLimit)) {
+        if (stepField()) {
+            break;
+        }
+        if (!streamFrame()) {
+            break;
+        }
+        if (TraceRequested()) {
+            dumpTrace();
+        }
+        if (statsEvery != 0 && STAT_GET(generation) % statsEvery == 0) {
+            dumpStats();
+        }
+    }
+    dumpStats();
+
+    CloseFrameStream(&frameOut);
+    CloseVideoStream(&video);
+    FreeField(field, fieldSize);
+    FreeField(newField, fieldSize);
+    FreeCycleDetector(&cycles);
+    StopMetrics();
+    StopWorkers();
+    return 0;
+}
+
+static void applySetting(const char* key, const char* value) { // Shared by setup.json and --key value arguments
+    if (strcmp(key,"fieldSize") == 0) {
+        fieldSize = atoi(value);
+    }
+    else if (strcmp(key,"stepDelay") == 0) {
+        stepDelay = (float)atof(value);
+    }
+    else if (strcmp(key,"threads") == 0) {
+        threadCount = atoi(value);
+    }
+    else if (strcmp(key,"hugePages") == 0) {
+        hugePages = ParseHugePages(value);
+    }
+    else if (strcmp(key,"placement") == 0) {
+        placement = ParsePlacement(value);
+    }
+    else if (strcmp(key,"headless") == 0) {
+        headless = atoi(value) != 0;
+    }
+    else if (strcmp(key,"generations") == 0) {
+        generationLimit = strtoull(value, NULL, 10);
+    }
+    else if (strcmp(key,"statsEvery") == 0) {
+        statsEvery = strtoull(value, NULL, 10);
+    }
+    else if (strcmp(key,"statsFile") == 0) {
+        snprintf(statsFile, sizeof(statsFile), "%s", value);
+    }
+    else if (strcmp(key,"pattern") == 0) {
+        snprintf(patternFile, sizeof(patternFile), "%s", value);
+    }
+    else if (strcmp(key,"exportFile") == 0) {
+        snprintf(exportFile, sizeof(exportFile), "%s", value);
+    }
+    else if (strcmp(key,"traceFile") == 0) {
+        snprintf(traceFile, sizeof(traceFile), "%s", value);
+    }
+    else if (strcmp(key,"frames") == 0) {
+        snprintf(framesTarget, sizeof(framesTarget), "%s", value);
+    }
+    else if (strcmp(key,"frameEvery") == 0) {
+        frameEvery = strtoull(value, NULL, 10);
+        if (frameEvery == 0) frameEvery = 1;
+    }
+    else if (strcmp(key,"frameKeyEvery") == 0) {
+        frameKeyEvery = strtoull(value, NULL, 10);
+    }
+    else if (strcmp(key,"video") == 0) {
+        snprintf(videoTarget, sizeof(videoTarget), "%s", value);
+    }
+    else if (strcmp(key,"videoFormat") == 0) {
+        videoOutput = ParseVideoFormat(value);
+    }
+    else if (strcmp(key,"videoEvery") == 0) {
+        videoEvery = strtoull(value, NULL, 10);
+        if (videoEvery == 0) videoEvery = 1;
+    }
+    else if (strcmp(key,"videoScale") == 0) {
+        videoScale = atoi(value);
+    }
+    else if (strcmp(key,"videoFps") == 0) {
+        videoFps = atoi(value) > 0 ? atoi(value) : 30;
+    }
+    else if (strcmp(key,"cycleDetect") == 0) {
+        cycleDetect = atoi(value) != 0;
+    }
+    else if (strcmp(key,"cycleHistory") == 0) {
+        cycleHistory = atoi(value);
+    }
+    else if (strcmp(key,"rewindMemory") == 0) {
+        rewindMemory = strtoull(value, NULL, 10);
+    }
+    else if (strcmp(key,"undoMemory") == 0) {
+        undoMemory = strtoull(value, NULL, 10);
+    }
+    else if (strcmp(key,"census") == 0) {
+        snprintf(censusFile, sizeof(censusFile), "%s", value);
+    }
+    else if (strcmp(key,"soups") == 0) {
+        soupCount = strtoull(value, NULL, 10);
+    }
+    else if (strcmp(key,"soupSize") == 0) {
+        soupSize = atoi(value);
+    }
+    else if (strcmp(key,"censusField") == 0) {
+        censusField = atoi(value);
+    }
+    else if (strcmp(key,"censusSeed") == 0) {
+        censusSeed = strtoull(value, NULL, 10);
+    }
+    else if (strcmp(key,"soupGenerations") == 0) {
+        soupGenerations = strtoull(value, NULL, 10);
+    }
+    else if (strcmp(key,"fillDensity") == 0) {
+        fillDensity = atof(value);
+    }
+    else if (strcmp(key,"fillSeed") == 0) {
+        fillSeed = strtoull(value, NULL, 10);
+    }
+    else if (strcmp(key,"fillStart") == 0) {
+        fillStart = atoi(value) != 0;
+    }
+    else if (strcmp(key,"ensemble") == 0) {
+        snprintf(ensembleFile, sizeof(ensembleFile), "%s", value);
+    }
+    else if (strcmp(key,"ensembleRules") == 0) {
+        snprintf(ensembleRules, sizeof(ensembleRules), "%s", value);
+    }
+    else if (strcmp(key,"universes") == 0) {
+        universeCount = atoi(value);
+    }
+    else if (strcmp(key,"ensembleSize") == 0) {
+        ensembleSize = atoi(value);
+    }
+    else if (strcmp(key,"ensembleGenerations") == 0) {
+        ensembleGenerations = strtoull(value, NULL, 10);
+    }
+    else if (strcmp(key,"bitSliced") == 0) {
+        bitSliced = atoi(value) != 0;
+    }
+    else if (strcmp(key,"shards") == 0) {
+        shardCount = atoi(value) > 0 ? atoi(value) : 0;
+    }
+    else if (strcmp(key,"labelGap") == 0) {
+        labelGap = atoi(value) > 0 ? atoi(value) : 1;
+    }
+    else if (strcmp(key,"metrics") == 0) {
+        snprintf(metricsAddress, sizeof(metricsAddress), "%s", value);
+    }
+    else if (strcmp(key,"engine") == 0) {
+        activeEngine = ParseEngine(value);
+    }
+    else if (strcmp(key,"rule") == 0) {
+        if (!ParseRule(value, &activeRule)) {
+            fprintf(stderr, "Error: unknown rule %s\n", value);
+        }
+    }
+    else if (strcmp(key,"topology") == 0) {
+        if (!ParseTopology(value, &activeTopology)) {
+            fprintf(stderr, "Error: unknown topology %s\n", value);
+        }
+    }
+    else {
+        fprintf(stderr, "Error: unknown setting %s\n", key);
+    }
+}
+
+int main(int argc, char** argv) {
+    TraceThread("main");
+    TraceOnSignal();
+    ParseRule("B3/S23", &activeRule);
     char* rawJson = ReadJson("configs/setup.json");
     if (rawJson != NULL){
         returnPair Pair = ParseJson(rawJson);
         for (int i = 0; i < Pair.size; i++){
-            if (strcmp(Pair.data[i].key,"fieldSize") == 0) {
-                fieldSize = atoi(Pair.data[i].value);
-            }
-            else if (strcmp(Pair.data[i].key,"stepDelay") == 0) {
-                stepDelay = (float)atof(Pair.data[i].value);
-            }
+            applySetting(Pair.data[i].key, Pair.data[i].value);
         }
         free(Pair.data);
     }
     free(rawJson);
+
+    for (int i = 1; i < argc; i++) { // --key value or --key=value overrides setup.json
+        if (strncmp(argv[i], "--", 2) != 0) continue;
+        char* equals = strchr(argv[i], '=');
+        if (equals != NULL) {
+            *equals = '\0';
+            applySetting(argv[i] + 2, equals + 1);
+        }
+        else if (i + 1 < argc) {
+            applySetting(argv[i] + 2, argv[i + 1]);
+            i++;
+        }
+    }
+
+    if (headless && framesTarget[0] != '\0' && !OpenFrameStream(&frameOut, framesTarget, fieldSize, frameKeyEvery)) { // Before anything prints, stdout may carry the frames
+        fprintf(stderr, "Error: cannot open frame stream %s\n", framesTarget);
+        CloseFrameStream(&frameOut);
+    }
+    if (videoTarget[0] != '\0') {
+        float live[3];
+        cellColor(1, live);
+        if (!OpenVideoStream(&video, videoTarget, videoOutput, fieldSize, videoScale, videoFps, live, backgroundColor)) {
+            fprintf(stderr, "Error: cannot open video output %s\n", videoTarget);
+            CloseVideoStream(&video);
+        }
+    }
+    if (headless && shardCount > 1) { // Shards replace the simulation, each process starts its own workers
+        bool ok = startShards();
+        CloseFrameStream(&frameOut);
+        CloseVideoStream(&video);
+        return ok ? 0 : 1;
+    }
+    StartWorkers(threadCount);
+    if (censusFile[0] != '\0' || ensembleFile[0] != '\0') { // A census or an ensemble replaces the simulation
+        bool ok = censusFile[0] != '\0' ? startCensus() : startEnsemble();
+        CloseFrameStream(&frameOut);
+        CloseVideoStream(&video);
+        StopWorkers();
+        return ok ? 0 : 1;
+    }
+    CreateCycleDetector(&cycles, cycleHistory);
+    field = CreateField(fieldSize);
+    newField = CreateField(fieldSize);
+    CreateRewindLog(&history, fieldSize, headless ? 0 : (size_t)rewindMemory << 20); // Only the window can step back
+    CreateEditHistory(&edits, fieldSize, headless ? 0 : (size_t)undoMemory << 20);
+    printNodeUsage();
+
+    bool loaded = patternFile[0] != '\0' && loadPattern(patternFile);
+    if (!loaded && fillStart) {
+        randomFill(0, 0, fieldSize, fieldSize);
+    } else if (!loaded) {
+        // Initial pattern (Glider)
+        field[1][2] = 1;
+        field[2][3] = 1;
+        field[3][1] = 1;
+        field[3][2] = 1;
+        field[3][3] = 1;
+    }
+    STAT_SET(population, CountField(field, fieldSize));
+    recordVideo();
+    stats.startNs = MonotonicNs();
+    if (metricsAddress[0] != '\0' && !StartMetrics(metricsAddress)) {
+        fprintf(stderr, "Error: cannot serve metrics on %s\n", metricsAddress);
+    }
+
+    if (headless) {
+        return runHeadless();
+    }
     
     GLFWwindow* window;
 
@@ -296,6 +1080,7 @@ int main(void) {
 
     setWindowIcon(window, "src/icon.png");
     glfwMakeContextCurrent(window);
+    glfwSetDropCallback(window, dropCallback);
 
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
@@ -303,50 +1088,88 @@ int main(void) {
     glMatrixMode(GL_MODELVIEW);
 
     cellSize = gridSize / fieldSize;
-    field = CreateField(fieldSize);
-    newField = CreateField(fieldSize);
-
-    // Initial pattern (Glider)
-    field[1][2] = 1;
-    field[2][3] = 1;
-    field[3][1] = 1;
-    field[3][2] = 1;
-    field[3][3] = 1;
 
     while (!glfwWindowShouldClose(window)) {
+        TRACE_SCOPE("frame");
         cellSize = gridSize / fieldSize;
 
-        glClearColor(0.1f, 0.1f, 0.15f, 1.0f);
+        glClearColor(backgroundColor[0], backgroundColor[1], backgroundColor[2], 1.0f);
         glClear(GL_COLOR_BUFFER_BIT);
         
-        drawGrid();
+        {
+            TRACE_SCOPE("drawGrid");
+            drawGrid();
+        }
         double currentTime = glfwGetTime();
 
         if(glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_RELEASE) {
             lastCellI = -1;
             lastCellJ = -1;
+            EndStroke(&edits);
         }
         if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS) {
             mouseButtonCallback(window, GLFW_MOUSE_BUTTON_LEFT, GLFW_PRESS, 0);
         }
+        unsigned short cellI, cellJ;
+        if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS && cellAt(window, &cellI, &cellJ)) { // Right drag selects a region to fill
+            if (fillAnchorI < 0) {
+                fillAnchorI = cellI;
+                fillAnchorJ = cellJ;
+            }
+            fillCornerI = cellI;
+            fillCornerJ = cellJ;
+        } else if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_RELEASE && fillAnchorI >= 0) {
+            int top = fillAnchorI < fillCornerI ? fillAnchorI : fillCornerI, left = fillAnchorJ < fillCornerJ ? fillAnchorJ : fillCornerJ;
+            shouldWait = true;
+            randomFill(top, left, abs(fillCornerI - fillAnchorI) + 1, abs(fillCornerJ - fillAnchorJ) + 1);
+            fillAnchorI = fillAnchorJ = -1;
+        }
 
-        fillField(field, fieldSize);
+        {
+            TRACE_SCOPE("fillField");
+            fillField(field, fieldSize);
+        }
+        drawLabels();
+        drawSelection();
         
         if (!shouldWait && currentTime - lastStepTime >= stepDelay) {
-            NextStep(field, newField,fieldSize);
-            swapFields(&field, &newField, fieldSize);
+            if (stepField()) {
+                shouldWait = true;
+            }
             lastStepTime = currentTime;
         }
 
+        if (currentTime - lastTitleTime >= 0.25) {
+            updateTitle(window);
+            lastTitleTime = currentTime;
+        }
+        if (TraceRequested()) {
+            dumpTrace();
+        }
+
         glfwSetKeyCallback(window, KeyPressed);
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        {
+            TRACE_SCOPE("glfwSwapBuffers");
+            glfwSwapBuffers(window);
+        }
+        {
+            TRACE_SCOPE("glfwPollEvents");
+            glfwPollEvents();
+        }
     }
 
     FreeField(field, fieldSize);
     FreeField(newField, fieldSize);
     FreeField(savedField, fieldSize);
+    FreeRewindLog(&history);
+    FreeEditHistory(&edits);
+    FreeLabeller(&labels);
+    free(labelPacked);
+    CloseVideoStream(&video);
+    FreeCycleDetector(&cycles);
+    StopMetrics();
+    StopWorkers();
 
     glfwTerminate();
     return 0;